@@ -12,62 +12,255 @@
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/dma-mapping.h>
+#include <linux/poll.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/version.h>
 #include <linux/ioctl.h>
 #include <linux/sched.h>
 #include <linux/semaphore.h>
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
 #include <linux/random.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <asm/uaccess.h>
 
 #include "atri-pcie.h"
 #include "evt_queue.h"
+#include "atri-sim.h"
+#include "atri-stats.h"
 
-int              gDrvrMajor = 241;           // Major number not dynamic.
-unsigned int     gStatFlags = 0x00;          // Status flags used for cleanup.
-unsigned long    gBaseHdwr;                  // Base register address (Hardware address)
-unsigned long    gBaseLen;                   // Base register address Length
-void            *gBaseVirt = NULL;           // Base register address (Virtual address, for I/O).
-char             gDrvrName[]= "atri-pcie";   // Name of driver in proc.
-struct pci_dev  *gDev = NULL;                // PCI device structure.
-int              gDie = 0;                   // Global shutdown flag to die gracefully
-int              gReadAbort = 0;             // Global read abort flag when released
-
-// Test pattern counter
-int              gXferCount = 1;             // Debug test pattern counter
+#define CREATE_TRACE_POINTS
+#include "atri-trace.h"
 
-// Device semaphores
-DEFINE_SEMAPHORE(gSemOpen);
-DEFINE_SEMAPHORE(gSemRead);
-
-// Dropped interrupt timer 
-static struct timer_list irq_timer;
+char             gDrvrName[]= "atri-pcie";   // Name of driver in proc.
+dev_t            gDevNum;                    // First of our dynamic device numbers
+struct class    *gClass = NULL;              // Device class, for udev
+struct dentry   *gDebugDir = NULL;           // debugfs directory for statistics
+
+// Ring geometry
+static unsigned int gNevt = NEVT;
+module_param_named(nevt, gNevt, uint, S_IRUGO);
+MODULE_PARM_DESC(nevt, "Number of event ring slots (power of two)");
+
+static unsigned int gEvtBufSize = EVTBUFSIZE;
+module_param_named(evtbufsize, gEvtBufSize, uint, S_IRUGO);
+MODULE_PARM_DESC(evtbufsize, "Size of each event ring slot in bytes");
+
+static unsigned int gArenaBytes = 0;
+module_param_named(arena_bytes, gArenaBytes, uint, S_IRUGO);
+MODULE_PARM_DESC(arena_bytes, "Pack events into a DMA arena of this many bytes (0 = one buffer per slot)");
+
+// DMA buffer memory
+static int gStreamingDma = 0;
+module_param_named(streaming_dma, gStreamingDma, int, S_IRUGO);
+MODULE_PARM_DESC(streaming_dma, "DMA into cached pages with streaming mappings instead of coherent memory");
+
+// Number of ring slots kept posted for DMA
+static unsigned int dma_depth = 4;
+module_param(dma_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(dma_depth, "Free ring slots kept posted for DMA (1..nevt)");
+
+// What to do when the ring is full
+static unsigned int gOverflow = XPCIE_OVF_BLOCK;
+module_param_named(overflow, gOverflow, uint, S_IRUGO);
+MODULE_PARM_DESC(overflow, "Full ring: 0 = stall the endpoint, 1 = drop oldest event, 2 = drop newest event");
+
+// Keep acquiring while no reader has the device open
+static int gFreeRun = 0;
+module_param_named(free_run, gFreeRun, int, S_IRUGO);
+MODULE_PARM_DESC(free_run, "Start DMA at load time and keep it going without a reader");
+
+static unsigned int gFreeRunOverflow = XPCIE_OVF_DROP_OLDEST;
+module_param_named(free_run_overflow, gFreeRunOverflow, uint, S_IRUGO);
+MODULE_PARM_DESC(free_run_overflow, "Full ring with no reader, when free-running (see overflow)");
+
+// Complete transfers and re-arm DMA from a threaded IRQ handler
+static int gThreadedIrq = 0;
+module_param_named(threaded_irq, gThreadedIrq, int, S_IRUGO);
+MODULE_PARM_DESC(threaded_irq, "Handle DMA completion in a threaded IRQ and re-arm from there");
+
+// Polled completion under load.  Writable, so they can be tuned
+// through /sys/module/atri_pcie/parameters while running.
+static unsigned int gPollEnterHz = 0;
+module_param_named(poll_enter_hz, gPollEnterHz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_enter_hz, "Poll for DMA completion above this event rate (0 = always use interrupts)");
+
+static unsigned int gPollExitHz = 0;
+module_param_named(poll_exit_hz, gPollExitHz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_exit_hz, "Go back to interrupts below this event rate (0 = half of poll_enter_hz)");
+
+static unsigned int gPollUs = 50;
+module_param_named(poll_us, gPollUs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_us, "Polling period in microseconds");
+
+static unsigned int gPollBudget = 16;
+module_param_named(poll_budget, gPollBudget, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(poll_budget, "Most completions retired per polling pass");
+
+// Lost-interrupt watchdog, tuned from recent transfer times
+static unsigned int gWdMult = 8;
+module_param_named(wd_mult, gWdMult, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wd_mult, "Check for a lost interrupt after this many times the p99 transfer time");
+
+static unsigned int gWdMinUs = 1000;
+module_param_named(wd_min_us, gWdMinUs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(wd_min_us, "Shortest wait before checking for a lost interrupt, in microseconds");
+
+// CPU placement, per board
+static int gIrqCpu[XPCIE_MAX_DEVS] = { [0 ... XPCIE_MAX_DEVS-1] = -1 };
+module_param_array_named(irq_cpu, gIrqCpu, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(irq_cpu, "CPU for each board's interrupt (-1 = any CPU local to the board)");
+
+static int gDmaCpu[XPCIE_MAX_DEVS] = { [0 ... XPCIE_MAX_DEVS-1] = -1 };
+module_param_array_named(dma_cpu, gDmaCpu, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(dma_cpu, "CPU for each board's DMA setup worker (-1 = any CPU)");
 
-//  DMA ring buffer for event transfer
-evtq           *gEvtQ = NULL;
+//
+// Per-board state.  Each board has its own registers, IRQ, ring,
+// DMA worker and device file /dev/atri-pcieN; nothing is shared
+// between boards except the table of boards below.
+//
+typedef struct {
+    struct pci_dev  *pdev;                   // PCI device structure (NULL if simulated)
+    int              minor;                  // Board number and device minor
+    char             name[16];               // atri-pcieN, for messages
+    unsigned int     statFlags;              // Status flags used for cleanup.
+    unsigned long    baseHdwr;               // Base register address (Hardware address)
+    unsigned long    baseLen;                // Base register address Length
+    void            *baseVirt;               // Base register address (Virtual address, for I/O).
+    int              die;                    // Shutdown flag to die gracefully
+    int              readAbort;              // Read abort flag when released
+    int              dmaPause;               // Don't arm DMA while the ring is changed
+    atomic_t         mmapCount;              // Active mmap views of the ring
+    int              xferCount;              // Debug test pattern counter
+    struct semaphore semOpen;                // Single reader
+    unsigned long    consumer;               // XPCIE_CLAIM_* bits on the ring's consumer side
+    int              framed;                 // read() returns an evtframe before each event
+    unsigned int     busyPollUs;             // Reader spins this long before sleeping
+    u64              partialSeq;             // event read() stopped partway through
+    int              partial;                // ... and it's still to be finished
+    unsigned int     spliceHeld;             // Spliced slots at rd_idx waiting on their pipe buffers
+    atomic_t         pipeRefs;               // Pipe buffers pointing into the ring, plus one for the board
+    int              orphan;                 // Torn down; the last pipe buffer frees it
+    unsigned int     ubufNext;               // Next user buffer to hand out
+    unsigned int     overflow;               // XPCIE_OVF_* policy when the ring is full
+    int              freeRun;                // Keep acquiring without a reader
+    unsigned int     freeOverflow;           // Overflow policy while free-running without a reader
+    int              freeIdle;               // Free-running with no reader; overflow is freeOverflow
+    unsigned int     readerOverflow;         // The reader's policy, put back at the next open
+    struct fasync_struct *fasync;            // SIGIO when the ring gets almost full
+    struct hrtimer   irq_timer;              // Dropped interrupt watchdog
+    u64              wdArm;                  // When the transfer in flight was armed (ns)
+    u64              wdTimeout;              // First check after arming (ns)
+    u64              wdNext;                 // Next check of the transfer in flight (ns)
+    unsigned int     wdCount;                // Transfers in the current p99 window
+    unsigned int     wdHist[STATS_LAT_BINS]; // Their arm-to-completion times, log2 us
+    struct hrtimer   poll_timer;             // Completion polling under load
+    int              polling;                // Completions are polled, not interrupt driven
+    int              pollTimerOn;            // poll_timer is queued or running
+    int              pollArmed;              // Transfer in flight has its interrupt disabled
+    unsigned int     rateCount;              // Completions in the current rate window
+    u64              rateStart;              // Start of the window (ns)
+    struct workqueue_struct *dma_setup_wq;   // Work queue for DMA setup
+    struct work_struct dma_work;
+    int              dmaCpu;                 // CPU the DMA setup runs on, or -1
+    int              irqCpu;                 // CPU the interrupt is steered to, or -1
+    evtq            *evtQ;                   // DMA ring buffer for event transfer
+    struct cdev      cdev;
+    simdev           sim;                    // Simulated endpoint
+    xpcie_stats __percpu *stats;             // Per-CPU counters
+    struct dentry   *debugDir;               // debugfs/atri-pcie/atri-pcieN
+    struct device   *device;                 // Class device, with the link attributes
+    int              linkSpeed;              // Negotiated link speed (PCI_EXP_LNKSTA_CLS)
+    int              linkWidth;              // Negotiated lanes
+    int              maxLinkSpeed;           // What the endpoint supports
+    int              maxLinkWidth;
+    int              mps;                    // Max payload size (bytes)
+    int              mrrs;                   // Max read request size (bytes)
+    u32              tlpStat;                // REG_DLTRSSTAT at probe
+    unsigned int     tlpDwords;              // TLP payload used for test transfers
+    int              dmaBits;                // DMA address width
+} xpcie_dev;
+
+// Boards by minor number
+static xpcie_dev *gDevs[XPCIE_MAX_DEVS];
+static DEFINE_MUTEX(gDevsLock);
+
+// Torn down boards whose ring is still in pipes; module exit waits for them
+static atomic_t gOrphans = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(gOrphanWaitq);
 
 //-----------------------------------------------------------------------------
 // Prototypes
 //-----------------------------------------------------------------------------
 
 irq_handler_t xpcie_irq_handler(int irq, void *dev_id, struct pt_regs *regs);
-void irq_timer_callback(unsigned long data);
-void xpcie_dump_regs(void);
-u32 xpcie_read_reg(u32 dw_offset);
-void xpcie_write_reg(u32 dw_offset, u32 val);
-void xpcie_init_card(void);
-void xpcie_initiator_reset(void);
-unsigned int xpcie_get_transfer_size(void);
-int xpcie_dma_wr_done(void);
+enum hrtimer_restart irq_timer_callback(struct hrtimer *t);
+void xpcie_wd_sample(xpcie_dev *xd, u64 ns);
+void xpcie_dump_regs(xpcie_dev *xd);
+u32 xpcie_read_reg(xpcie_dev *xd, u32 dw_offset);
+void xpcie_write_reg(xpcie_dev *xd, u32 dw_offset, u32 val);
+void xpcie_init_card(xpcie_dev *xd);
+void xpcie_initiator_reset(xpcie_dev *xd);
+unsigned int xpcie_get_transfer_size(xpcie_dev *xd);
+int xpcie_dma_wr_done(xpcie_dev *xd);
+void xpcie_link_probe(xpcie_dev *xd);
+const char *xpcie_link_speed(int speed);
+u64 xpcie_selftest_xfer(xpcie_dev *xd, int rd);
+long xpcie_run_selftest(struct file *filp, xpcie_selftest __user *ust);
+int xpcie_ring_ok(unsigned nevt, unsigned bufsize, unsigned arena_bytes);
 void xpcie_remove(struct pci_dev *dev);
-void xpcie_queue_flush(void);
+void xpcie_queue_flush(xpcie_dev *xd);
 int xpcie_probe(struct pci_dev *dev, const struct pci_device_id *id);
+xpcie_dev *xpcie_alloc_dev(struct pci_dev *dev);
+int xpcie_setup(xpcie_dev *xd);
+void xpcie_teardown(xpcie_dev *xd);
+void xpcie_put_dev(xpcie_dev *xd);
 void dma_setup(struct work_struct *work);
-
-// Work queue for DMA setup
-static struct workqueue_struct *dma_setup_wq;
-static DECLARE_WORK(dma_work, dma_setup);
+void xpcie_dma_arm(xpcie_dev *xd);
+void xpcie_dma_post(xpcie_dev *xd);
+void xpcie_dma_quiesce(xpcie_dev *xd);
+void xpcie_dma_resume(xpcie_dev *xd);
+void xpcie_queue_dma(xpcie_dev *xd);
+void xpcie_irq_affinity(xpcie_dev *xd);
+long xpcie_local_cpus(xpcie_dev *xd, xpcie_cpus __user *ucpus);
+long xpcie_ring_size(struct file *filp, xpcie_ringsize __user *ursz);
+long xpcie_set_userbuf(struct file *filp, xpcie_userbuf *ub);
+long xpcie_userbuf_ioctl(struct file *filp, xpcie_userbuf __user *uub);
+long xpcie_userbuf_next(struct file *filp, xpcie_ubuf_evt __user *uevt);
+int xpcie_ubuf_out(xpcie_dev *xd);
+int xpcie_wait_event(struct file *filp);
+int xpcie_busy_poll(xpcie_dev *xd, unsigned int us);
+long xpcie_read_batch(struct file *filp, xpcie_batch __user *ubatch);
+int xpcie_mmap_coherent(xpcie_dev *xd);
+int xpcie_mmap_ring(xpcie_dev *xd, struct vm_area_struct *vma);
+int xpcie_claim(xpcie_dev *xd);
+void xpcie_unclaim(xpcie_dev *xd);
+int xpcie_hold(xpcie_dev *xd);
+void xpcie_unhold(xpcie_dev *xd);
+unsigned xpcie_unread(xpcie_dev *xd);
+int xpcie_spliced(xpcie_dev *xd);
+void xpcie_splice_reap(xpcie_dev *xd);
+ssize_t xpcie_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                          size_t len, unsigned int flags);
+int xpcie_set_overflow(xpcie_dev *xd, unsigned int policy);
+long xpcie_overflow_ioctl(xpcie_dev *xd, xpcie_overflow __user *uovf);
+void xpcie_free_run_idle(xpcie_dev *xd);
+long xpcie_free_run_ioctl(xpcie_dev *xd, xpcie_freerun __user *ufr);
+int xpcie_fasync(int fd, struct file *filp, int on);
+int xpcie_drop_oldest(xpcie_dev *xd);
+int xpcie_can_overflow(xpcie_dev *xd);
+int xpcie_dma_complete(xpcie_dev *xd);
+void xpcie_dma_wake(xpcie_dev *xd, int almost_full, int idle);
+void xpcie_poll_check(xpcie_dev *xd);
+enum hrtimer_restart xpcie_poll_timer(struct hrtimer *t);
 
 //-----------------------------------------------------------------------------
 // PCI driver struct
@@ -93,33 +286,79 @@ static struct pci_driver pci_driver = {
 
 int xpcie_open(struct inode *inode, struct file *filp) {
 
+    xpcie_dev *xd = container_of(inode->i_cdev, xpcie_dev, cdev);
+    unsigned long flags;
+    int dying;
+
     // Limit to one reader at a time
     // Hold the semaphore until close    
-    if (down_trylock(&gSemOpen))
+    if (down_trylock(&xd->semOpen))
         return -EINVAL;
 
-    // Reset any previous abort flags
-    gReadAbort = gDie = 0;
+    // The board is being torn down; die is only ever set, never
+    // cleared, so an open can't revive DMA behind the teardown
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+    dying = xd->die;
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+    if (dying) {
+        up(&xd->semOpen);
+        return -ENODEV;
+    }
+    filp->private_data = xd;
+
+    // Reset any previous abort flag and read mode
+    xd->readAbort = 0;
+    xd->framed = 0;
+    xd->partial = 0;
+    xd->busyPollUs = 0;
+
+    // Free-running: DMA kept going.  Back to the reader's overflow
+    // policy; buffered events are left for it.
+    if (xd->freeIdle) {
+        xd->freeIdle = 0;
+        if (xpcie_set_overflow(xd, xd->readerOverflow) != SUCCESS)
+            printk(KERN_WARNING "%s: Open: can't restore overflow policy %u\n",
+                   xd->name, xd->readerOverflow);
+    }
     
     // Set up the first DMA transfer
-    queue_work(dma_setup_wq, &dma_work);
+    xpcie_queue_dma(xd);
 
-    PDEBUG("%s: Open: module opened\n",gDrvrName);    
+    PDEBUG("%s: Open: module opened\n",xd->name);    
     return SUCCESS;
 }
 
 int xpcie_release(struct inode *inode, struct file *filp) {
 
+    xpcie_dev *xd = filp->private_data;
+
+    // No more almost-full signals
+    xpcie_fasync(-1, filp, 0);
+
     // Bail out of any waiting reads
-    gReadAbort = 1;
-    wake_up_interruptible(&gEvtQ->rd_waitq);    
+    xd->readAbort = 1;
+    wake_up_interruptible(&xd->evtQ->rd_waitq);    
+
+    // Nobody is left to finish a partly read event
+    xd->partial = 0;
+
+    // Stop the IRQ watchdog, unless DMA is to keep going
+    if (!xd->freeRun)
+        hrtimer_cancel(&xd->irq_timer);
+
+    // Unpin any user buffers
+    if (xd->evtQ->upages != NULL) {
+        xpcie_userbuf ub = { 0, 0, 0 };
+        if (xpcie_set_userbuf(filp, &ub) != SUCCESS)
+            printk(KERN_WARNING "%s: Release: user buffers still pinned\n", xd->name);
+    }
 
-    // Stop the IRQ timeout timer
-    del_timer(&irq_timer);
+    if (xd->freeRun)
+        xpcie_free_run_idle(xd);
 
     // Release the single-reader lock
-    up(&gSemOpen);
-    PDEBUG("%s: Release: device released\n",gDrvrName);    
+    up(&xd->semOpen);
+    PDEBUG("%s: Release: device released\n",xd->name);    
     return SUCCESS;
 }
 
@@ -128,532 +367,2342 @@ int xpcie_release(struct inode *inode, struct file *filp) {
 //
 ssize_t xpcie_read(struct file *filp, char *buf, size_t count, loff_t *f_pos) {
 
+    xpcie_dev *xd = filp->private_data;
     evtbuf *eb;
-    size_t nbytes;
+    evtframe fr;
+    size_t hdrlen = xd->framed ? sizeof(fr) : 0;
+    size_t pos;
+    size_t nbytes, n = 0;
     int next_event = 0;
+    int ret;
     
-    PDEBUG("%s: reading %d bytes (offset %d)\n", gDrvrName, (int)count, (int)*f_pos);
-
-    if (down_interruptible(&gSemRead))
-        return -ERESTARTSYS;
-    
-    // Check if event queue is empty
-    // FIX ME: this lock may not be necessary since the open() is locked
-    while (evtq_isempty(gEvtQ) && !gReadAbort) {
-        up(&gSemRead); 
-
-        // If we're non blocking, return
-        if (filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
+    PDEBUG("%s: reading %d bytes (offset %d)\n", xd->name, (int)count, (int)*f_pos);
 
-        // Otherwise, wait until there is something there
-        if (wait_event_interruptible(gEvtQ->rd_waitq, !evtq_isempty(gEvtQ)))
-            return -ERESTARTSYS; /* signal caught */
-
-        /* Loop, but first reacquire the lock */
-        if (down_interruptible(&gSemRead))
-            return -ERESTARTSYS;
-    }
+    ret = xpcie_wait_event(filp);
+    if (ret != SUCCESS)
+        return ret;
 
     // If we're about to shutdown, don't go any further
-    if (gReadAbort) {
-        up(&gSemRead);
+    if (xd->readAbort) {
+        xpcie_unclaim(xd);
         return 0;
     }
+
+    // The head of the ring still belongs to a pipe
+    if (xpcie_spliced(xd)) {
+        xpcie_unclaim(xd);
+        return -EBUSY;
+    }
     
-    eb = evtq_getevent(gEvtQ, gEvtQ->rd_idx);
+    eb = evtq_getevent(xd->evtQ, xd->evtQ->rd_idx);
+
+    // Drop-oldest leaves a partly read event alone, so if it's gone
+    // the ring was flushed or resized under us
+    if (*f_pos && (!xd->partial || (eb->seq != xd->partialSeq))) {
+        *f_pos = 0;
+        xpcie_unclaim(xd);
+        return -EPIPE;
+    }
+    pos = *f_pos;
 
     // TEMP FIX ME DEBUG
     /*
-    PDEBUG("%s: buffer bytes: %02x %02x %02x %02x %02x %02x %02x %02x...\n", gDrvrName,
+    PDEBUG("%s: buffer bytes: %02x %02x %02x %02x %02x %02x %02x %02x...\n", xd->name,
            eb->buf[0], eb->buf[1], eb->buf[2], eb->buf[3],
            eb->buf[4], eb->buf[5], eb->buf[6], eb->buf[7]);           
     */
 
     // See how many more bytes are available in this event    
-    if ((eb->len - *f_pos) <= count) {
-        nbytes = (eb->len - *f_pos);
+    if ((hdrlen + eb->len - pos) <= count) {
+        nbytes = (hdrlen + eb->len - pos);
         next_event = 1;
     }
     else
         nbytes = count;
+
+    // In framed mode the event starts with its header
+    if (pos < hdrlen) {
+        fr.len = eb->len;
+        fr.pad = 0;
+        fr.seq = eb->seq;
+        fr.t_arm = eb->t_arm;
+        fr.t_done = eb->t_done;
+        n = min(nbytes, hdrlen - pos);
+        if (copy_to_user(buf, (char *)&fr + pos, n)) {
+            xpcie_unclaim(xd);
+            return -EFAULT;
+        }
+        pos += n;
+    }
     
-    if (copy_to_user(buf, &(eb->buf[*f_pos]), nbytes)) {
-        up(&gSemRead);
+    if (copy_to_user(buf + n, &(eb->buf[pos - hdrlen]), nbytes - n)) {
+        xpcie_unclaim(xd);
         return -EFAULT;
     }
 
     // Have we wrapped into a new event?
     if (next_event) {        
-        // Once event has been read, increment the read pointer.
+        // Once event has been read, publish the read pointer.
         // Wake up any sleeping write preparation.
-        // FIX ME: should this be atomic?
-        gEvtQ->rd_idx++;
-        wake_up_interruptible(&gEvtQ->wr_waitq);
+        stats_read_done(xd->stats, eb);
+        trace_atri_read(xd->minor, xd->evtQ->rd_idx, 1);
+        evtq_release(xd->evtQ, 1);
         *f_pos = 0;
+        xd->partial = 0;
     }
     else {
         *f_pos += nbytes;
+        xd->partialSeq = eb->seq;
+        xd->partial = 1;
     }
     
-    up(&gSemRead);
+    xpcie_unclaim(xd);
 
-    PDEBUG("%s: xpcie_read: %d bytes have been read...\n", gDrvrName, (int)nbytes);
+    PDEBUG("%s: xpcie_read: %d bytes have been read...\n", xd->name, (int)nbytes);
     return nbytes;
 }
 
-//
-// xpcie_ioctl: (limited) driver control via IOCTL operations
-//
-long xpcie_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-  
-  long ret = SUCCESS;
-  
-  switch (cmd) {
-      
-  case XPCIE_IOCTL_INIT:          // Initialize the firmware
-      printk(KERN_INFO "%s: ioctl INIT\n", gDrvrName);
-      xpcie_init_card();
-      break;
-  case XPCIE_IOCTL_FLUSH:         // Flush the event queue
-      // FIX ME: this could hose stuff if called at the wrong time?
-      printk(KERN_INFO "%s: ioctl FLUSH\n", gDrvrName);      
-      xpcie_queue_flush();
-      break;
-  default:
-      break;
-  }
-  
-  return ret;
+// The ring has a single consumer.  Readers claim the consumer side
+// rather than lock it; a concurrent second reader gets -EBUSY.
+// Drop-oldest also moves rd_idx, from the producer side; it only
+// holds the ring for a moment and never while a reader has claimed
+// it, so the reader just waits it out.  Both bits are set with full
+// barriers before checking the other one.
+int xpcie_claim(xpcie_dev *xd) {
+    if (test_and_set_bit(XPCIE_CLAIM_READER, &xd->consumer))
+        return -EBUSY;
+    while (test_bit(XPCIE_CLAIM_HOLD, &xd->consumer))
+        cpu_relax();
+    smp_mb();
+    return SUCCESS;
 }
 
-//-----------------------------------------------------------------------------
-// Module file operations and init/exit.  Real initialization and exit
-// done by probe/remove; this just registers the driver structure.
-//
+void xpcie_unclaim(xpcie_dev *xd) {
+    clear_bit_unlock(XPCIE_CLAIM_READER, &xd->consumer);
 
-struct file_operations xpcie_intf = {
-    read:           xpcie_read,
-    unlocked_ioctl: xpcie_ioctl,    
-    open:           xpcie_open,
-    release:        xpcie_release,
-};
+    // Pipe buffers consumed while we held the ring could not give
+    // their slots back; do it for them
+    if (ACCESS_ONCE(xd->spliceHeld))
+        xpcie_splice_reap(xd);
+}
 
-static int __init xpcie_init(void) {
-    return pci_register_driver(&pci_driver);
+// Hold the consumer side for a moment, unless a reader has claimed
+// it.  Doesn't wait; returns 0 if the ring can't be held.
+int xpcie_hold(xpcie_dev *xd) {
+    if (test_and_set_bit(XPCIE_CLAIM_HOLD, &xd->consumer))
+        return 0;
+    if (test_bit(XPCIE_CLAIM_READER, &xd->consumer)) {
+        clear_bit_unlock(XPCIE_CLAIM_HOLD, &xd->consumer);
+        return 0;
+    }
+    return 1;
 }
 
-static void __exit xpcie_exit(void) {
-    pci_unregister_driver(&pci_driver);
+void xpcie_unhold(xpcie_dev *xd) {
+    clear_bit_unlock(XPCIE_CLAIM_HOLD, &xd->consumer);
 }
 
-//-----------------------------------------------------------------------------
-// Device probe and remove: since we're not hotplugging, called on
-// module load and remove
-//
-int xpcie_probe(struct pci_dev *dev, const struct pci_device_id *id) {
+// Events not yet read (or spliced)
+unsigned xpcie_unread(xpcie_dev *xd) {
+    return evtq_avail(xd->evtQ) - ACCESS_ONCE(xd->spliceHeld);
+}
 
-    int irqFlags = 0;
+// Are any slots at the head of the ring still in a pipe?  Call with
+// the consumer side claimed.
+int xpcie_spliced(xpcie_dev *xd) {
+    return xd->spliceHeld ||
+        atomic_read(&evtq_getevent(xd->evtQ, xd->evtQ->rd_idx)->refs);
+}
 
-    // Kernel has found a device for us
-    gDev = dev;
+// Wait until there is an event to read (or the reader is aborted).
+// On success, returns with the consumer side claimed.
+int xpcie_wait_event(struct file *filp) {
 
-    // Enable device
-    if (0 > pci_enable_device(gDev)) {
-        printk(KERN_WARNING "%s: probe: Device not enabled.\n", gDrvrName);
-        return (CRIT_ERR);
-    }
-    
-    // Get Base Address of registers from pci structure. Should come from pci_dev
-    // structure, but that element seems to be missing on the development system.
-    gBaseHdwr = pci_resource_start(gDev, 0);
-    
-    if (0 > gBaseHdwr) {
-        printk(KERN_WARNING "%s: probe: Base Address not set.\n", gDrvrName);
-        return (CRIT_ERR);
-    } 
-    PDEBUG("%s: probe: Base hw val %lx\n", gDrvrName, (unsigned long)gBaseHdwr);
-    
-    // Get the Base Address Length
-    gBaseLen = pci_resource_len(gDev, 0);
-    PDEBUG("%s: probe: Base hw len %d\n", gDrvrName, (unsigned int)gBaseLen);
-    
-    // Remap the I/O register block so that it can be safely accessed.
-    // I/O register block starts at gBaseHdwr and is 32 bytes long.
-    gBaseVirt = ioremap(gBaseHdwr, gBaseLen);
-    if (!gBaseVirt) {
-        printk(KERN_WARNING "%s: probe: Could not remap memory.\n", gDrvrName);
-        return (CRIT_ERR);
-    } 
-    PDEBUG("%s: probe: Virt HW address %lX\n", gDrvrName, (unsigned long)gBaseVirt);
-        
-    // Check the memory region to see if it is in use
-    if (0 > check_mem_region(gBaseHdwr, PCIE_REGISTER_SIZE)) {
-        printk(KERN_WARNING "%s: probe: Memory in use.\n", gDrvrName);
-        return (CRIT_ERR);
-    }
-    
-    // Try to gain exclusive control of memory for demo hardware.
-    request_mem_region(gBaseHdwr, PCIE_REGISTER_SIZE, "3GIO_Demo_Drv");
-    // Update flags
-    gStatFlags = gStatFlags | HAVE_REGION;
-    
-    PDEBUG("%s: probe: Initialize Hardware Done..\n",gDrvrName);
-    
-    PDEBUG("%s: IRQ Setup..\n", gDrvrName);
-    // Request IRQ from OS
-    // Try to get an MSI interrupt
-    if (PCI_USE_MSI) {
-        if (pci_enable_msi(gDev) < 0) {
-            printk(KERN_WARNING "%s: probe: Unable to enable MSI",gDrvrName);    
-            return (CRIT_ERR);
-        }        
-        PDEBUG("%s: MSI interrupt; device IRQ is %d\n", gDrvrName, gDev->irq);
-    }
-    else {
-        irqFlags |= IRQF_SHARED;
-        PDEBUG("%s: shared interrupt; device IRQ is %d\n", gDrvrName, gDev->irq);        
-    }
-    
-    if (0 > request_irq(gDev->irq, (irq_handler_t) xpcie_irq_handler, irqFlags, gDrvrName, gDev)) {
-        printk(KERN_WARNING "%s: probe: Unable to allocate IRQ",gDrvrName);
-        return (CRIT_ERR);
-    }
-    // Update flags stating IRQ was successfully obtained
-    gStatFlags = gStatFlags | HAVE_IRQ;
-        
-    // Set address range for DMA transfers
-    if (pci_set_dma_mask(gDev, PCI_HW_DMA_MASK) < 0) {
-        printk(KERN_WARNING "%s: probe: DMA mask could not be set.\n", gDrvrName);
-        return (CRIT_ERR);
-    }
-    
-    //--- END: Initialize Hardware
-    
-    //--- START: Register Driver
-    
-    // Register with the kernel as a character device.
-    if (0 > register_chrdev(gDrvrMajor, gDrvrName, &xpcie_intf)) {
-        printk(KERN_WARNING "%s: probe: will not register\n", gDrvrName);
-        return (CRIT_ERR);
-    }
-    PDEBUG("%s: probe: module registered\n", gDrvrName);
-    gStatFlags = gStatFlags | HAVE_KREG;
-    
-    //--- END: Register Driver
+    xpcie_dev *xd = filp->private_data;
+
+    if (xpcie_claim(xd))
+        return -EBUSY;
     
-    // Create DMA workqueue
-    dma_setup_wq = create_singlethread_workqueue("atri-pcie-dma-work");
-    if (dma_setup_wq == NULL) {
-        printk(KERN_WARNING "%s: probe: couldn't create DMA workqueue\n", gDrvrName);
-        return (CRIT_ERR);
-    }
-    gStatFlags = gStatFlags | HAVE_WQ;
+    // Check if event queue is empty
+    while (!xpcie_unread(xd) && !xd->readAbort) {
+        xpcie_unclaim(xd); 
 
-    // Create event queue
-    gEvtQ = new_evtq(gDev);
-    if (gEvtQ == NULL) {
-        printk(KERN_ALERT "%s: Open: couldn't create event queue\n",gDrvrName);
-        return (CRIT_ERR);
+        // If we're non blocking, return
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        // Low-latency readers spin for a while first
+        if (xd->busyPollUs && xpcie_busy_poll(xd, xd->busyPollUs))
+            stats_inc(xd->stats, busy_poll_hits);
+        else {
+            if (xd->busyPollUs)
+                stats_inc(xd->stats, busy_poll_misses);
+
+            // Otherwise, wait until there is something there
+            if (wait_event_interruptible(xd->evtQ->rd_waitq, 
+                                         xpcie_unread(xd) || xd->readAbort))
+                return -ERESTARTSYS; /* signal caught */
+        }
+
+        /* Loop, but first reclaim the ring */
+        if (xpcie_claim(xd))
+            return -EBUSY;
     }
-    
-    // Initialize card registers
-    xpcie_init_card();
+    return SUCCESS;
+}
 
-    // Set up (but don't arm) interrupt timer
-    setup_timer(&irq_timer, irq_timer_callback, 0);
+// Spin on the ring for up to us microseconds, without sleeping.
+// Returns 1 if an event (or an abort) turned up.  Gives up early if
+// the CPU is wanted elsewhere or a signal is pending.
+int xpcie_busy_poll(xpcie_dev *xd, unsigned int us) {
 
-    printk(KERN_ALERT "%s: driver is loaded\n", gDrvrName);
-        
+    u64 end = stats_now() + (u64) us * NSEC_PER_USEC;
+
+    do {
+        if (xpcie_unread(xd) || xd->readAbort)
+            return 1;
+        if (need_resched() || signal_pending(current))
+            break;
+        cpu_relax();
+    } while (stats_now() < end);
     return 0;
 }
 
-// Performs any cleanup required before removing the device
-void xpcie_remove(struct pci_dev *dev) {
+//
+// xpcie_read_batch: copy as many whole events as fit into the user
+// buffer, each with an evthdr, and release them all at once.
+//
+long xpcie_read_batch(struct file *filp, xpcie_batch __user *ubatch) {
+
+    xpcie_dev *xd = filp->private_data;
+    xpcie_batch b;
+    evthdr hdr;
+    evtbuf *eb;
+    char __user *dst;
+    unsigned i, avail;
+    size_t used = 0, need;
+    long ret;
 
-    // Delete the interrupt timer
-    del_timer_sync(&irq_timer);
+    if (copy_from_user(&b, ubatch, sizeof(b)))
+        return -EFAULT;
+    dst = (char __user *)(unsigned long) b.buf;
 
-    // Set the abort flags
-    gReadAbort = gDie = 1;
+    ret = xpcie_wait_event(filp);
+    if (ret != SUCCESS)
+        return ret;
 
-    // Wake up any sleeping DMA setup and reads and don't restart
-    if (gEvtQ != NULL) {
-        PDEBUG("%s: empty event queue\n", gDrvrName);
-        xpcie_queue_flush();
+    if (xpcie_spliced(xd)) {
+        xpcie_unclaim(xd);
+        return -EBUSY;
     }
-        
-    // Flush the DMA workqueue and destroy it
-    if (gStatFlags & HAVE_WQ) {
-        PDEBUG("%s: destroy workqueue\n", gDrvrName);        
-        flush_workqueue(dma_setup_wq);
-        destroy_workqueue(dma_setup_wq);
+
+    // Batches only hand out whole events
+    if (filp->f_pos != 0) {
+        if (xd->partial &&
+            (evtq_getevent(xd->evtQ, xd->evtQ->rd_idx)->seq == xd->partialSeq)) {
+            xpcie_unclaim(xd);
+            return -EBUSY;
+        }
+        // That event was flushed or resized away
+        filp->f_pos = 0;
+        xpcie_unclaim(xd);
+        return -EPIPE;
     }
-    
-    // Check if we have a memory region and free it
-    if (gStatFlags & HAVE_REGION) {
-        PDEBUG("%s: release memory\n",gDrvrName);        
-        release_mem_region(gBaseHdwr, PCIE_REGISTER_SIZE);
+
+    avail = xd->readAbort ? 0 : evtq_avail(xd->evtQ);
+    for (i = 0; i < avail; i++) {
+        eb = evtq_getevent(xd->evtQ, xd->evtQ->rd_idx + i);
+        need = ALIGN(sizeof(hdr) + eb->len, EVTHDR_ALIGN);
+        if (used + need > b.size)
+            break;
+
+        hdr.len = eb->len;
+        hdr.seq = eb->seq;
+        if (copy_to_user(dst + used, &hdr, sizeof(hdr)) ||
+            copy_to_user(dst + used + sizeof(hdr), eb->buf, eb->len)) {
+            xpcie_unclaim(xd);
+            return -EFAULT;
+        }
+        stats_read_done(xd->stats, eb);
+        used += need;
     }
-    
-    // Check if we have an IRQ and free it
-    if (gStatFlags & HAVE_IRQ) {
-        PDEBUG("%s: free IRQ %d\n",gDrvrName, gDev->irq);    
-        free_irq(gDev->irq, gDev);
-        if (PCI_USE_MSI)
-            pci_disable_msi(gDev);    
+
+    // Not even one event fits
+    if ((i == 0) && (avail > 0)) {
+        xpcie_unclaim(xd);
+        return -EMSGSIZE;
     }
-    
-    // Free up memory pointed to by virtual address
-    if (gBaseVirt != NULL) {
-        PDEBUG("%s: unmap memory\n",gDrvrName);          
-        iounmap(gBaseVirt);
-        gBaseVirt = NULL;
+
+    if (i > 0) {
+        trace_atri_read(xd->minor, xd->evtQ->rd_idx, i);
+        evtq_release(xd->evtQ, i);
     }
-    
-    // Unregister Device Driver
-    if (gStatFlags & HAVE_KREG) {
-        PDEBUG("%s: unregister driver\n",gDrvrName);        
-        unregister_chrdev(gDrvrMajor, gDrvrName);
-    }  
-    gStatFlags = 0;
+    xpcie_unclaim(xd);
 
-    // Release event queue memory
-    PDEBUG("%s: delete event queue structure\n",gDrvrName);
-    delete_evtq(gEvtQ);
-    
-    printk(KERN_ALERT "%s driver is unloaded\n", gDrvrName);
+    PDEBUG("%s: read batch: %u events, %u bytes\n", xd->name, i, (unsigned)used);
+
+    b.nevt = i;
+    b.nbytes = used;
+    if (copy_to_user(ubatch, &b, sizeof(b)))
+        return -EFAULT;
+    return SUCCESS;
 }
 
 //-----------------------------------------------------------------------------
-// Interrupt handling and DMA setup
+// Device splice: move events into a pipe without copying them
+//
+// The pipe gets the pages of the event ring itself, so only rings of
+// ordinary pages can be spliced: streaming buffers (allocated as
+// compound pages, so every page in them can be referenced) and pinned
+// user buffers.  Each pipe buffer counts against its slot, and a slot
+// is only handed back to DMA once it was spliced to the end and the
+// pipe has let go of all its pages.  Until then read(), batches,
+// flushes, releases and drop-oldest leave the head of the ring alone.
+// Each pipe buffer also counts against the board.  Teardown doesn't
+// wait for them: if any are left, the last one frees the ring and
+// the board, and only module exit waits.
 //
 
-irq_handler_t xpcie_irq_handler(int irq, void *dev_id, struct pt_regs *regs) {
+// Pipe buffers name their board and slot
+#define SPLICE_TAG(xd, idx)  ((xd)->minor * NEVT_MAX + ((idx) & (xd)->evtQ->mask))
 
-    unsigned long flags;
-    evtbuf *eb;
-    
-    spin_lock_irqsave(&gEvtQ->lock, flags);
+static void xpcie_splice_put(unsigned long tag) {
+    xpcie_dev *xd = gDevs[tag / NEVT_MAX];
 
-    // Disable the lost interrupt timer
-    del_timer(&irq_timer);
-    
-    PDEBUG("%s: Interrupt Handler Start ..",gDrvrName);
+    if (atomic_dec_and_test(&xd->evtQ->evt[tag % NEVT_MAX].refs))
+        xpcie_splice_reap(xd);
+    xpcie_put_dev(xd);
+}
 
-    if (!gDie) {
-        // Read out the actual transfer length and set in event    
-        eb = evtq_getevent(gEvtQ, gEvtQ->wr_idx);
-        eb->len = xpcie_get_transfer_size();
-    
-        // Data is now ready for processer. Increment the write pointer
-        // and wake up and waiting reads
-        gEvtQ->wr_idx++;
-        gXferCount++;
-    }    
-    gEvtQ->dma_started = 0;    
-    spin_unlock_irqrestore(&gEvtQ->lock, flags);
-    
-    wake_up_interruptible(&gEvtQ->rd_waitq);
-   
-    // Put the setup for the next write into a workqueue.
-    // It can sleep so cannot be done here
-    if (!gDie)
-        queue_work(dma_setup_wq, &dma_work);
-    
-    PDEBUG("%s evt_queue: %u events\n", gDrvrName, evtq_entries(gEvtQ));
-    PDEBUG("%s Interrupt Handler End ..\n", gDrvrName);
+static void xpcie_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+    xpcie_splice_put(buf->private);
+}
 
-    return (irq_handler_t) IRQ_HANDLED;
+static void xpcie_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+    xpcie_dev *xd = gDevs[buf->private / NEVT_MAX];
+
+    atomic_inc(&xd->pipeRefs);
+    atomic_inc(&xd->evtQ->evt[buf->private % NEVT_MAX].refs);
 }
 
-void dma_setup(struct work_struct *work) {
-    evtbuf *eb;
-    u32 tlp_cnt;
-    unsigned long flags;
-    
-    PDEBUG("%s: DMA write setup\n", gDrvrName);
+// The pages belong to the ring
+static int xpcie_pipe_buf_steal(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+    return 1;
+}
 
-    // This part is locked against the top half of the interrupt
-    // handler.  Otherwise we could send the wrong address.
-    spin_lock_irqsave(&gEvtQ->lock, flags);
+static const struct pipe_buf_operations xpcie_pipe_buf_ops = {
+    .can_merge = 0,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,15,0)
+    .map = generic_pipe_buf_map,
+    .unmap = generic_pipe_buf_unmap,
+#endif
+    .confirm = generic_pipe_buf_confirm,
+    .release = xpcie_pipe_buf_release,
+    .steal = xpcie_pipe_buf_steal,
+    .get = xpcie_pipe_buf_get,
+};
 
-    // Have we already done this, but not received an interrupt?
-    if (gEvtQ->dma_started) {
-        printk(KERN_WARNING "%s: dma_setup: DMA is already in progress, not starting another!\n",gDrvrName);
-        spin_unlock(&gEvtQ->lock);
-        return;        
-    }
-    
-    // If the queue is full, wait until it is not    
-    while (evtq_isfull(gEvtQ) && !gDie) {
-        // but don't hold the lock
-        spin_unlock(&gEvtQ->lock);
-        if (wait_event_interruptible(gEvtQ->wr_waitq, !evtq_isfull(gEvtQ)))
-            continue;
-        // Reaquire lock
-        spin_lock_irqsave(&gEvtQ->lock, flags);
-    }
+// Pages that didn't fit in the pipe
+static void xpcie_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+    xpcie_splice_put(spd->partial[i].private);
+}
 
-    // If we're about to shutdown, don't go any further
-    if (gDie) {
-        spin_unlock(&gEvtQ->lock);
-        return;
-    }
+// Give back the spliced slots at the head of the ring that no pipe
+// buffer points into any more.  If the ring is claimed, the claimer
+// does this when it lets go.  Otherwise the ring is only held, like
+// drop-oldest does, so a reader coming in meanwhile waits a moment
+// rather than failing with -EBUSY.
+void xpcie_splice_reap(xpcie_dev *xd) {
+
+    evtq *q = xd->evtQ;
+    unsigned n;
+
+    for (;;) {
+        // Order the unclaim or the pipe buffer put before the checks
+        smp_mb();
+        if (!ACCESS_ONCE(xd->spliceHeld) ||
+            atomic_read(&evtq_getevent(q, ACCESS_ONCE(q->rd_idx))->refs))
+            return;
+
+        // Readers spin on the hold, so don't get preempted holding it
+        preempt_disable();
+        while (!xpcie_hold(xd)) {
+            if (test_bit(XPCIE_CLAIM_READER, &xd->consumer)) {
+                preempt_enable();
+                return;
+            }
+            cpu_relax();
+        }
 
-    PDEBUG("%s: DMA is%s done\n", gDrvrName,
-                       xpcie_dma_wr_done() ? "" : " NOT");
+        for (n = 0; n < xd->spliceHeld; n++) {
+            if (atomic_read(&evtq_getevent(q, q->rd_idx + n)->refs))
+                break;
+            stats_read_done(xd->stats, evtq_getevent(q, q->rd_idx + n));
+        }
+        if (n > 0) {
+            trace_atri_read(xd->minor, q->rd_idx, n);
+            xd->spliceHeld -= n;
+            evtq_release(q, n);
+        }
+        xpcie_unhold(xd);
+        preempt_enable();
+    }
+}
 
-    eb = evtq_getevent(gEvtQ, gEvtQ->wr_idx);        
+ssize_t xpcie_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                          size_t len, unsigned int flags) {
+
+    xpcie_dev *xd = filp->private_data;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages = 0,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+#endif
+        .flags = flags,
+        .ops = &xpcie_pipe_buf_ops,
+        .spd_release = xpcie_spd_release,
+    };
+    evtbuf *eb;
+    unsigned idx;
+    size_t pos, n;
+    unsigned char *addr;
+    ssize_t ret;
 
-    // Reset the initiator.  This also clears the DONE bit.
-    if (XILINX_TEST_MODE)
-        xpcie_initiator_reset();
-    
-    // Write the PCIe write DMA address to the device
-    xpcie_write_reg(REG_WDMATLPA, eb->physaddr);
+    // Frames aren't in the ring, so there is nothing to splice them from
+    if (xd->framed)
+        return -EINVAL;
 
-    // For testing with Xilinx XAPP1052 firmware
-    if (XILINX_TEST_MODE) {
-        // Write: Write DMA Expected Data Pattern with default value
-        xpcie_write_reg(REG_WDMATLPP, gXferCount);
-        // Write: Write DMA TLP Size register (4 dwords)
-        xpcie_write_reg(REG_WDMATLPS, 0x4);
-        // Write: Write DMA TLP Count register (randomize!)
-        get_random_bytes(&tlp_cnt, 4);
-        xpcie_write_reg(REG_WDMATLPC, (tlp_cnt&0x7ff)+1);
+ next:
+    if ((flags & SPLICE_F_NONBLOCK) && !xpcie_unread(xd))
+        return -EAGAIN;
+    ret = xpcie_wait_event(filp);
+    if (ret != SUCCESS)
+        return ret;
+    if (xd->readAbort) {
+        xpcie_unclaim(xd);
+        return 0;
     }
-    else {
-        // Overloaded: additional waiting time for transfer start: 
-        // nwords(16 downto 0) + ('0' & nwords(16 downto 0)) - REG_RDMATLPP
-        xpcie_write_reg(REG_RDMATLPP, 0);
-    }    
-    mmiowb();
-
-    // Tell the device to start DMA
-    xpcie_write_reg(REG_DDMACR, DDMACR_WR_START);
-    mmiowb();
 
-    // Record that we've started a DMA
-    gEvtQ->dma_started = 1;
+    // The next event after the ones already in the pipe
+    idx = xd->evtQ->rd_idx + xd->spliceHeld;
+    eb = evtq_getevent(xd->evtQ, idx);
 
-    // Set up a timer in case we lose the interrupt
-    irq_timer.expires = jiffies+msecs_to_jiffies(IRQ_TIMEOUT_MS);
-    add_timer(&irq_timer);
-    
-    spin_unlock(&gEvtQ->lock);    
-}
+    // Pipes can only take refcounted pages of the kernel's linear map
+    if (!evtq_has_pages(xd->evtQ) || !virt_addr_valid(eb->buf)) {
+        xpcie_unclaim(xd);
+        return -EINVAL;
+    }
 
-// Timer is fired if we don't receive an interrupt for
-// a certain period of time
-void irq_timer_callback(unsigned long data) {
+    // Nothing to splice for an empty event; don't report end of file
+    if (eb->len == 0) {
+        xd->spliceHeld++;
+        *ppos = 0;
+        xpcie_unclaim(xd);
+        goto next;
+    }
 
-    unsigned long flags;
-    
-    spin_lock_irqsave(&gEvtQ->lock, flags);
-    printk(KERN_WARNING "%s: no IRQ in %d ms!\n",gDrvrName, IRQ_TIMEOUT_MS);
-    
-    // Did we somehow forget to set up a transfer?  
-    if (!(gEvtQ->dma_started)) {
-        printk(KERN_WARNING "%s: irq timeout: setting up another transfer.\n",gDrvrName);
-        queue_work(dma_setup_wq, &dma_work);
+    // As in read(), a partly spliced event is never dropped
+    if (*ppos && (!xd->partial || (eb->seq != xd->partialSeq))) {
+        *ppos = 0;
+        xpcie_unclaim(xd);
+        return -EPIPE;
     }
-    else {
-        // If we started a transfer but just never got the interrupt,
-        // check to see if it's done
-        if (xpcie_dma_wr_done()) {
-            printk(KERN_WARNING "%s: irq timeout: DMA done; force call to handler.\n",gDrvrName);
-            // Call the interrupt handler ourselves!
-            xpcie_irq_handler(gDev->irq, NULL, NULL);
+    pos = *ppos;
+    len = min(len, eb->len - pos);
+
+    // One pipe buffer per page, as many as the pipe takes at once
+    while ((len > 0) && (spd.nr_pages < PIPE_DEF_BUFFERS)) {
+        addr = eb->buf + pos;
+        n = min_t(size_t, len, PAGE_SIZE - offset_in_page(addr));
+        pages[spd.nr_pages] = virt_to_page(addr);
+        partial[spd.nr_pages].offset = offset_in_page(addr);
+        partial[spd.nr_pages].len = n;
+        partial[spd.nr_pages].private = SPLICE_TAG(xd, idx);
+        atomic_inc(&xd->pipeRefs);
+        atomic_inc(&eb->refs);
+        spd.nr_pages++;
+        pos += n;
+        len -= n;
+    }
+
+    ret = splice_to_pipe(pipe, &spd);
+    if (ret > 0) {
+        *ppos += ret;
+        if (*ppos == eb->len) {
+            // Handed back once the pipe is done with it
+            xd->spliceHeld++;
+            *ppos = 0;
+            xd->partial = 0;
         }
         else {
-            // DMA was started but is not done.  That is probably bad.
-            printk(KERN_WARNING "%s: irq timeout: DMA started but not done; trying again.\n",gDrvrName);
-            gEvtQ->dma_started = 0;            
-            xpcie_initiator_reset();
-            queue_work(dma_setup_wq, &dma_work);
+            xd->partialSeq = eb->seq;
+            xd->partial = 1;
         }
     }
+    xpcie_unclaim(xd);
 
-    spin_unlock_irqrestore(&gEvtQ->lock, flags);    
-
-    return;       
+    PDEBUG("%s: splice: %d bytes\n", xd->name, (int)ret);
+    return ret;
 }
 
-// Queue flush
-void xpcie_queue_flush(void) {
+//-----------------------------------------------------------------------------
+// Device poll: readable when the ring has events, priority data when
+// it is almost full
+//
+unsigned int xpcie_poll(struct file *filp, poll_table *wait) {
+
+    xpcie_dev *xd = filp->private_data;
+    unsigned int mask = 0;
 
-    unsigned long flags;
-    
-    // Lock the event queue and empty it
-    spin_lock_irqsave(&gEvtQ->lock, flags);
-    empty_evtq(gEvtQ);
-    spin_unlock_irqrestore(&gEvtQ->lock, flags);
+    poll_wait(filp, &xd->evtQ->rd_waitq, wait);
 
-    // Wake up stuff that was waiting
-    wake_up_interruptible(&gEvtQ->wr_waitq);
-    wake_up_interruptible(&gEvtQ->rd_waitq);
-    
-    return;
+    if (xpcie_unread(xd))
+        mask |= POLLIN | POLLRDNORM;
+    if (evtq_isalmostfull(xd->evtQ))
+        mask |= POLLPRI;
+    if (xd->readAbort)
+        mask |= POLLHUP;
+
+    return mask;
+}
+
+//-----------------------------------------------------------------------------
+// Device mmap: zero-copy access to the event ring
+//
+// The mapping is read-only.  It starts with the control area (evtq_ctrl,
+// ctrl->ctrl_bytes long), followed by the DMA buffers (one per slot, or
+// the chunks of a packed arena), each ctrl->slot_bytes apart.  The
+// control area gives the offset of each event.  Coherent buffers can
+// only be mapped one per mmap(), at their offset in this layout.  Events are handed back
+// to the DMA side with XPCIE_IOCTL_RELEASE, passing the ring index
+// just past the last one the reader is done with.
+//
+
+// Count the mappings, so the ring isn't reallocated under them
+void xpcie_vm_open(struct vm_area_struct *vma) {
+    xpcie_dev *xd = vma->vm_private_data;
+    atomic_inc(&xd->mmapCount);
+}
+
+void xpcie_vm_close(struct vm_area_struct *vma) {
+    xpcie_dev *xd = vma->vm_private_data;
+    atomic_dec(&xd->mmapCount);
+}
+
+static struct vm_operations_struct xpcie_vm_ops = {
+    .open = xpcie_vm_open,
+    .close = xpcie_vm_close,
+};
+
+// Coherent buffers belong to the DMA API, which knows how (and with
+// what caching) to map them; remap_pfn_range is only right for plain
+// pages.  dma_mmap_coherent maps a whole vma into one buffer, so each
+// coherent buffer needs an mmap() of its own.  Before 3.6 there is no
+// dma_mmap_coherent, and coherent memory is plain pages (x86).
+int xpcie_mmap_coherent(xpcie_dev *xd) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+    return (xd->evtQ->dev != NULL) && !(xd->evtQ->blk[0].flags & EVTBUF_PAGES);
+#else
+    return 0;
+#endif
+}
+
+// The ring can't be reallocated under a mapping being set up, so
+// this is done with the consumer side claimed, like a resize
+int xpcie_mmap(struct file *filp, struct vm_area_struct *vma) {
+
+    xpcie_dev *xd = filp->private_data;
+    int ret;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    if (xpcie_claim(xd))
+        return -EBUSY;
+    ret = xpcie_mmap_ring(xd, vma);
+    if (ret == SUCCESS) {
+        vma->vm_ops = &xpcie_vm_ops;
+        vma->vm_private_data = xd;
+        xpcie_vm_open(vma);
+    }
+    xpcie_unclaim(xd);
+
+    PDEBUG("%s: mmap: mapped %lu pages\n", xd->name, 
+           (vma->vm_end - vma->vm_start) >> PAGE_SHIFT);
+    return ret;
+}
+
+// Map the ring's control area and buffers into vma
+int xpcie_mmap_ring(xpcie_dev *xd, struct vm_area_struct *vma) {
+
+    unsigned long uaddr = vma->vm_start;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long pg = vma->vm_pgoff;
+    unsigned long pfn, npg, len;
+    unsigned long ctrl_pages = 1 << xd->evtQ->ctrl_order;
+    unsigned long blk_pg;
+    evtbuf *blk;
+
+    if ((pg + (size >> PAGE_SHIFT)) > xd->evtQ->mmap_pages)
+        return -EINVAL;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_IO | VM_DONTEXPAND;
+#ifdef VM_RESERVED
+    vma->vm_flags |= VM_RESERVED;
+#endif
+
+    // One coherent buffer, or a part of it
+    if ((pg >= ctrl_pages) && xpcie_mmap_coherent(xd)) {
+        blk = &xd->evtQ->blk[(pg - ctrl_pages) / xd->evtQ->blk_pages];
+        blk_pg = (pg - ctrl_pages) % xd->evtQ->blk_pages;
+        if (blk_pg + (size >> PAGE_SHIFT) > xd->evtQ->blk_pages)
+            return -EINVAL;
+
+        // It takes vm_pgoff as the offset into the buffer
+        vma->vm_pgoff = blk_pg;
+        if (dma_mmap_coherent(evtq_dmadev(xd->evtQ), vma, blk->buf, blk->physaddr,
+                              xd->evtQ->blksize))
+            return -EAGAIN;
+        size = 0;
+    }
+    else if (xpcie_mmap_coherent(xd) && (pg + (size >> PAGE_SHIFT) > ctrl_pages))
+        return -EINVAL;
+
+    // Map the control area and event buffers piece by piece
+    while (size > 0) {
+        if (pg < ctrl_pages) {
+            pfn = (virt_to_phys(xd->evtQ->ctrl) >> PAGE_SHIFT) + pg;
+            npg = ctrl_pages - pg;
+        }
+        else {
+            blk = &xd->evtQ->blk[(pg - ctrl_pages) / xd->evtQ->blk_pages];
+            blk_pg = (pg - ctrl_pages) % xd->evtQ->blk_pages;
+            pfn = (virt_to_phys(blk->buf) >> PAGE_SHIFT) + blk_pg;
+            npg = xd->evtQ->blk_pages - blk_pg;
+        }
+        len = min(size, npg << PAGE_SHIFT);
+        if (remap_pfn_range(vma, uaddr, pfn, len, vma->vm_page_prot))
+            return -EAGAIN;
+        uaddr += len;
+        size -= len;
+        pg += len >> PAGE_SHIFT;
+    }
+    return SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Overflow policy and almost-full notification
+//
+
+// Signal (SIGIO, POLL_PRI) the reader when the ring gets almost full
+int xpcie_fasync(int fd, struct file *filp, int on) {
+    xpcie_dev *xd = filp->private_data;
+    return fasync_helper(fd, filp, on, &xd->fasync);
+}
+
+int xpcie_set_overflow(xpcie_dev *xd, unsigned int policy) {
+
+    if (policy >= XPCIE_OVF_NUM)
+        return -EINVAL;
+
+    // Dropped new events need somewhere to go.  Nothing is using
+    // the scratch buffer until the policy says so.
+    if ((policy == XPCIE_OVF_DROP_NEWEST) && (xd->evtQ->scratch.buf == NULL)) {
+        if (evtq_alloc_scratch(xd->evtQ))
+            return -ENOMEM;
+        smp_wmb();
+    }
+    xd->overflow = policy;
+
+    // DMA setup may be waiting on a full ring
+    wake_up_interruptible(&xd->evtQ->wr_waitq);
+    return SUCCESS;
+}
+
+// Nobody has the device open, but acquisition goes on: switch to
+// the free-running overflow policy and make sure DMA is armed
+void xpcie_free_run_idle(xpcie_dev *xd) {
+    xd->readerOverflow = xd->overflow;
+    if (xpcie_set_overflow(xd, xd->freeOverflow) != SUCCESS)
+        printk(KERN_WARNING "%s: free run: can't use overflow policy %u\n",
+               xd->name, xd->freeOverflow);
+    xd->freeIdle = 1;
+    if (!xd->die && !xd->dmaPause)
+        xpcie_queue_dma(xd);
+}
+
+long xpcie_free_run_ioctl(xpcie_dev *xd, xpcie_freerun __user *ufr) {
+
+    xpcie_freerun fr;
+
+    if (copy_from_user(&fr, ufr, sizeof(fr)))
+        return -EFAULT;
+
+    // Takes effect when the reader closes the device
+    if (fr.enable != XPCIE_FREERUN_QUERY) {
+        if (fr.overflow >= XPCIE_OVF_NUM)
+            return -EINVAL;
+        xd->freeOverflow = fr.overflow;
+        xd->freeRun = !!fr.enable;
+    }
+
+    fr.enable = xd->freeRun;
+    fr.overflow = xd->freeOverflow;
+    fr.pending = evtq_entries(xd->evtQ);
+    if (copy_to_user(ufr, &fr, sizeof(fr)))
+        return -EFAULT;
+    return SUCCESS;
+}
+
+long xpcie_overflow_ioctl(xpcie_dev *xd, xpcie_overflow __user *uovf) {
+
+    xpcie_overflow ovf;
+    long ret = SUCCESS;
+
+    if (copy_from_user(&ovf, uovf, sizeof(ovf)))
+        return -EFAULT;
+
+    if (ovf.policy != XPCIE_OVF_QUERY)
+        ret = xpcie_set_overflow(xd, ovf.policy);
+
+    ovf.policy = xd->overflow;
+    ovf.dropped = xd->evtQ->dropped;
+    if (copy_to_user(uovf, &ovf, sizeof(ovf)))
+        return -EFAULT;
+    return ret;
+}
+
+//
+// xpcie_ioctl: (limited) driver control via IOCTL operations
+//
+long xpcie_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  
+  xpcie_dev *xd = filp->private_data;
+  unsigned int i, n;
+  long ret = SUCCESS;
+  
+  switch (cmd) {
+      
+  case XPCIE_IOCTL_INIT:          // Initialize the firmware
+      printk(KERN_INFO "%s: ioctl INIT\n", xd->name);
+      xpcie_init_card(xd);
+      break;
+  case XPCIE_IOCTL_FLUSH:         // Flush the event queue
+      printk(KERN_INFO "%s: ioctl FLUSH\n", xd->name);      
+      if (xpcie_claim(xd))
+          return -EBUSY;
+      if (xpcie_spliced(xd))
+          ret = -EBUSY;
+      else {
+          xpcie_queue_flush(xd);
+          filp->f_pos = 0;
+      }
+      xpcie_unclaim(xd);
+      break;
+  case XPCIE_IOCTL_RELEASE:       // mmap reader is done with the events before index arg
+      if (xpcie_claim(xd))
+          return -EBUSY;
+      // The index is absolute, so drop-oldest moving rd_idx meanwhile
+      // can't make the reader give back events it hasn't seen
+      n = (unsigned int)arg - xd->evtQ->rd_idx;
+      if (xpcie_spliced(xd))
+          ret = -EBUSY;
+      else if ((int)n <= 0)
+          ret = -EPIPE;           // already dropped or released
+      else if (n > evtq_avail(xd->evtQ))
+          ret = -EINVAL;          // not written yet
+      else {
+          for (i = 0; i < n; i++)
+              stats_read_done(xd->stats, evtq_getevent(xd->evtQ, xd->evtQ->rd_idx + i));
+          trace_atri_read(xd->minor, xd->evtQ->rd_idx, n);
+          evtq_release(xd->evtQ, n);
+          filp->f_pos = 0;
+          xd->partial = 0;
+      }
+      xpcie_unclaim(xd);
+      break;
+  case XPCIE_IOCTL_READ_BATCH:    // read whole events with headers
+      ret = xpcie_read_batch(filp, (xpcie_batch __user *) arg);
+      break;
+  case XPCIE_IOCTL_RING_SIZE:     // query or reallocate the ring
+      ret = xpcie_ring_size(filp, (xpcie_ringsize __user *) arg);
+      break;
+  case XPCIE_IOCTL_OVERFLOW:      // set or query the overflow policy
+      ret = xpcie_overflow_ioctl(xd, (xpcie_overflow __user *) arg);
+      break;
+  case XPCIE_IOCTL_FRAMED:        // switch read() framing
+      // Not in the middle of an event
+      if (filp->f_pos != 0)
+          return -EBUSY;
+      xd->framed = (arg != 0);
+      break;
+  case XPCIE_IOCTL_USERBUF:       // DMA into a user buffer pool
+      ret = xpcie_userbuf_ioctl(filp, (xpcie_userbuf __user *) arg);
+      break;
+  case XPCIE_IOCTL_USERBUF_NEXT:  // next filled user buffer
+      ret = xpcie_userbuf_next(filp, (xpcie_ubuf_evt __user *) arg);
+      break;
+  case XPCIE_IOCTL_FREE_RUN:      // keep acquiring after close
+      ret = xpcie_free_run_ioctl(xd, (xpcie_freerun __user *) arg);
+      break;
+  case XPCIE_IOCTL_LOCAL_CPUS:    // CPUs close to the board
+      ret = xpcie_local_cpus(xd, (xpcie_cpus __user *) arg);
+      break;
+  case XPCIE_IOCTL_SELFTEST:      // test-pattern DMA self-test
+      ret = xpcie_run_selftest(filp, (xpcie_selftest __user *) arg);
+      break;
+  case XPCIE_IOCTL_BUSY_POLL:     // spin before sleeping in read
+      if (arg > BUSY_POLL_MAX_US)
+          return -EINVAL;
+      xd->busyPollUs = arg;
+      break;
+  default:                        // so callers can tell what the driver supports
+      ret = -ENOTTY;
+      break;
+  }
+  
+  return ret;
+}
+
+//-----------------------------------------------------------------------------
+// Module file operations and init/exit.  Real initialization and exit
+// done by probe/remove; this just registers the driver structure.
+//
+
+struct file_operations xpcie_intf = {
+    owner:          THIS_MODULE,
+    read:           xpcie_read,
+    splice_read:    xpcie_splice_read,
+    unlocked_ioctl: xpcie_ioctl,    
+    mmap:           xpcie_mmap,
+    poll:           xpcie_poll,
+    fasync:         xpcie_fasync,
+    open:           xpcie_open,
+    release:        xpcie_release,
+};
+
+//
+// debugfs: per-board statistics in debugfs/atri-pcie/atri-pcieN/stats
+//
+int xpcie_stats_show(struct seq_file *m, void *v) {
+    xpcie_dev *xd = m->private;
+
+    seq_printf(m, "ring             %u / %u\n", evtq_entries(xd->evtQ), xd->evtQ->nevt);
+    seq_printf(m, "completion       %s\n", xd->polling ? "polled" : "interrupt");
+    seq_printf(m, "watchdog_us      %llu\n", div_u64(xd->wdTimeout, NSEC_PER_USEC));
+    stats_show(m, xd->stats);
+    return 0;
+}
+
+int xpcie_stats_open(struct inode *inode, struct file *filp) {
+    return single_open(filp, xpcie_stats_show, inode->i_private);
+}
+
+static struct file_operations xpcie_stats_fops = {
+    owner:   THIS_MODULE,
+    open:    xpcie_stats_open,
+    read:    seq_read,
+    llseek:  seq_lseek,
+    release: single_release,
+};
+
+//
+// sysfs: what the PCIe link negotiated, read at probe time, in
+// /sys/class/atri-pcie/atri-pcieN.  All zero for a simulated endpoint.
+//
+#define XPCIE_LINK_ATTR(_name, _fmt, _val)                                  \
+static ssize_t xpcie_show_##_name(struct device *dev,                       \
+                                  struct device_attribute *attr, char *buf) { \
+    xpcie_dev *xd = dev_get_drvdata(dev);                                   \
+    return sprintf(buf, _fmt "\n", _val);                                   \
+}                                                                           \
+static DEVICE_ATTR(_name, S_IRUGO, xpcie_show_##_name, NULL)
+
+XPCIE_LINK_ATTR(link_speed, "%s", xpcie_link_speed(xd->linkSpeed));
+XPCIE_LINK_ATTR(link_width, "%d", xd->linkWidth);
+XPCIE_LINK_ATTR(max_link_speed, "%s", xpcie_link_speed(xd->maxLinkSpeed));
+XPCIE_LINK_ATTR(max_link_width, "%d", xd->maxLinkWidth);
+XPCIE_LINK_ATTR(max_payload, "%d", xd->mps);
+XPCIE_LINK_ATTR(max_read_request, "%d", xd->mrrs);
+XPCIE_LINK_ATTR(tlp_status, "0x%08x", xd->tlpStat);
+XPCIE_LINK_ATTR(tlp_dwords, "%u", xd->tlpDwords);
+XPCIE_LINK_ATTR(dma_bits, "%d", xd->dmaBits);
+
+static struct device_attribute *xpcie_link_attrs[] = {
+    &dev_attr_link_speed,
+    &dev_attr_link_width,
+    &dev_attr_max_link_speed,
+    &dev_attr_max_link_width,
+    &dev_attr_max_payload,
+    &dev_attr_max_read_request,
+    &dev_attr_tlp_status,
+    &dev_attr_tlp_dwords,
+    &dev_attr_dma_bits,
+};
+
+static int __init xpcie_init(void) {
+
+    xpcie_dev *xd;
+    int i, ret;
+
+    // One dynamic major, with a minor for each board
+    if (0 > alloc_chrdev_region(&gDevNum, 0, XPCIE_MAX_DEVS, gDrvrName)) {
+        printk(KERN_WARNING "%s: init: couldn't get device numbers\n", gDrvrName);
+        return (CRIT_ERR);
+    }
+    gClass = class_create(THIS_MODULE, gDrvrName);
+    if (IS_ERR(gClass)) {
+        printk(KERN_WARNING "%s: init: couldn't create device class\n", gDrvrName);
+        unregister_chrdev_region(gDevNum, XPCIE_MAX_DEVS);
+        return PTR_ERR(gClass);
+    }
+    gDebugDir = debugfs_create_dir(gDrvrName, NULL);
+    if (IS_ERR(gDebugDir))
+        gDebugDir = NULL;
+
+    // Simulated endpoints: no PCI devices to wait for
+    if (gSimMode) {
+        printk(KERN_INFO "%s: using %d simulated endpoint(s)\n", gDrvrName, gSimMode);
+        for (i = 0; i < gSimMode; i++) {
+            xd = xpcie_alloc_dev(NULL);
+            if (xd == NULL)
+                break;
+            xpcie_sim_init(&xd->sim, xpcie_irq_handler, xd);
+            if (xpcie_setup(xd) != SUCCESS) {
+                xpcie_teardown(xd);
+                break;
+            }
+        }
+        return SUCCESS;
+    }
+
+    ret = pci_register_driver(&pci_driver);
+    if (ret < 0) {
+        debugfs_remove(gDebugDir);
+        class_destroy(gClass);
+        unregister_chrdev_region(gDevNum, XPCIE_MAX_DEVS);
+    }
+    return ret;
+}
+
+static void __exit xpcie_exit(void) {
+
+    int i;
+
+    if (gSimMode) {
+        for (i = 0; i < XPCIE_MAX_DEVS; i++) {
+            if (gDevs[i] != NULL)
+                xpcie_teardown(gDevs[i]);
+        }
+    }
+    else
+        pci_unregister_driver(&pci_driver);
+
+    // The last pipe buffer of a torn down board runs this module's
+    // code, so wait for them.  Killable, since it's up to whoever
+    // holds the pipe.
+    if (atomic_read(&gOrphans)) {
+        printk(KERN_INFO "%s: waiting for spliced pages to be consumed\n", gDrvrName);
+        if (wait_event_killable(gOrphanWaitq, !atomic_read(&gOrphans)))
+            printk(KERN_ERR "%s: unloading with spliced pages still in pipes\n", gDrvrName);
+    }
+    synchronize_rcu();
+
+    debugfs_remove(gDebugDir);
+    class_destroy(gClass);
+    unregister_chrdev_region(gDevNum, XPCIE_MAX_DEVS);
+}
+
+//-----------------------------------------------------------------------------
+// Device probe and remove: since we're not hotplugging, called on
+// module load and remove, once for each board
+//
+int xpcie_probe(struct pci_dev *dev, const struct pci_device_id *id) {
+
+    xpcie_dev *xd;
+    int irqFlags = 0;
+
+    // Kernel has found a device for us
+    xd = xpcie_alloc_dev(dev);
+    if (xd == NULL)
+        return -ENOMEM;
+    pci_set_drvdata(dev, xd);
+
+    // Enable device
+    if (0 > pci_enable_device(dev)) {
+        printk(KERN_WARNING "%s: probe: Device not enabled.\n", xd->name);
+        goto fail;
+    }
+    xd->statFlags = xd->statFlags | HAVE_PCI;
+    
+    // Get Base Address of registers from pci structure. Should come from pci_dev
+    // structure, but that element seems to be missing on the development system.
+    xd->baseHdwr = pci_resource_start(dev, 0);
+    
+    if (0 > xd->baseHdwr) {
+        printk(KERN_WARNING "%s: probe: Base Address not set.\n", xd->name);
+        goto fail;
+    } 
+    PDEBUG("%s: probe: Base hw val %lx\n", xd->name, (unsigned long)xd->baseHdwr);
+    
+    // Get the Base Address Length
+    xd->baseLen = pci_resource_len(dev, 0);
+    PDEBUG("%s: probe: Base hw len %d\n", xd->name, (unsigned int)xd->baseLen);
+    
+    // Remap the I/O register block so that it can be safely accessed.
+    // I/O register block starts at baseHdwr and is 32 bytes long.
+    xd->baseVirt = ioremap(xd->baseHdwr, xd->baseLen);
+    if (!xd->baseVirt) {
+        printk(KERN_WARNING "%s: probe: Could not remap memory.\n", xd->name);
+        goto fail;
+    } 
+    PDEBUG("%s: probe: Virt HW address %lX\n", xd->name, (unsigned long)xd->baseVirt);
+        
+    // Check the memory region to see if it is in use
+    if (0 > check_mem_region(xd->baseHdwr, PCIE_REGISTER_SIZE)) {
+        printk(KERN_WARNING "%s: probe: Memory in use.\n", xd->name);
+        goto fail;
+    }
+    
+    // Try to gain exclusive control of memory for demo hardware.
+    request_mem_region(xd->baseHdwr, PCIE_REGISTER_SIZE, xd->name);
+    // Update flags
+    xd->statFlags = xd->statFlags | HAVE_REGION;
+    
+    PDEBUG("%s: probe: Initialize Hardware Done..\n",xd->name);
+    
+    PDEBUG("%s: IRQ Setup..\n", xd->name);
+    // Request IRQ from OS
+    // Try to get an MSI interrupt
+    if (PCI_USE_MSI) {
+        if (pci_enable_msi(dev) < 0) {
+            printk(KERN_WARNING "%s: probe: Unable to enable MSI",xd->name);    
+            goto fail;
+        }        
+        PDEBUG("%s: MSI interrupt; device IRQ is %d\n", xd->name, dev->irq);
+    }
+    else {
+        irqFlags |= IRQF_SHARED;
+        PDEBUG("%s: shared interrupt; device IRQ is %d\n", xd->name, dev->irq);        
+    }
+    
+    // In threaded mode the whole completion runs in the IRQ thread
+    if (gThreadedIrq) {
+        if (0 > request_threaded_irq(dev->irq, NULL, (irq_handler_t) xpcie_irq_handler, 
+                                     irqFlags | IRQF_ONESHOT, xd->name, xd)) {
+            printk(KERN_WARNING "%s: probe: Unable to allocate threaded IRQ",xd->name);
+            if (PCI_USE_MSI)
+                pci_disable_msi(dev);
+            goto fail;
+        }
+    }
+    else if (0 > request_irq(dev->irq, (irq_handler_t) xpcie_irq_handler, irqFlags, xd->name, xd)) {
+        printk(KERN_WARNING "%s: probe: Unable to allocate IRQ",xd->name);
+        if (PCI_USE_MSI)
+            pci_disable_msi(dev);
+        goto fail;
+    }
+    // Update flags stating IRQ was successfully obtained
+    xd->statFlags = xd->statFlags | HAVE_IRQ;
+    xpcie_irq_affinity(xd);
+        
+    // Set address range for DMA transfers, for the ring buffers as well
+    if ((pci_set_dma_mask(dev, DMA_BIT_MASK(PCI_HW_DMA_BITS)) < 0) ||
+        (pci_set_consistent_dma_mask(dev, DMA_BIT_MASK(PCI_HW_DMA_BITS)) < 0)) {
+        printk(KERN_WARNING "%s: probe: DMA mask could not be set.\n", xd->name);
+        goto fail;
+    }
+    xd->dmaBits = PCI_HW_DMA_BITS;
+
+    // What the link and the endpoint negotiated
+    xpcie_link_probe(xd);
+    
+    //--- END: Initialize Hardware
+
+    if (xpcie_setup(xd) == SUCCESS)
+        return SUCCESS;
+
+ fail:
+    // Remove won't be called for a board that failed to probe
+    xpcie_teardown(xd);
+    return (CRIT_ERR);
+}
+
+// Allocate the state for a new board and give it the first free
+// minor number.  dev is NULL for a simulated endpoint.
+xpcie_dev *xpcie_alloc_dev(struct pci_dev *dev) {
+
+    xpcie_dev *xd;
+    int minor;
+
+    xd = (xpcie_dev *) kzalloc(sizeof(xpcie_dev), GFP_KERNEL);
+    if (xd == NULL)
+        return NULL;
+    xd->stats = alloc_percpu(xpcie_stats);
+    if (xd->stats == NULL) {
+        kfree(xd);
+        return NULL;
+    }
+
+    mutex_lock(&gDevsLock);
+    for (minor = 0; minor < XPCIE_MAX_DEVS; minor++) {
+        if (gDevs[minor] == NULL)
+            break;
+    }
+    if (minor == XPCIE_MAX_DEVS) {
+        mutex_unlock(&gDevsLock);
+        printk(KERN_WARNING "%s: more than %d boards\n", gDrvrName, XPCIE_MAX_DEVS);
+        free_percpu(xd->stats);
+        kfree(xd);
+        return NULL;
+    }
+    gDevs[minor] = xd;
+    mutex_unlock(&gDevsLock);
+
+    xd->pdev = dev;
+    xd->minor = minor;
+    snprintf(xd->name, sizeof(xd->name), "%s%d", gDrvrName, minor);
+    xd->xferCount = 1;
+    xd->tlpDwords = TLP_DWORDS_DEFAULT;
+    xd->irqCpu = gIrqCpu[minor];
+    xd->dmaCpu = gDmaCpu[minor];
+    if ((xd->dmaCpu >= 0) && !cpu_online(xd->dmaCpu)) {
+        printk(KERN_WARNING "%s: CPU %d for DMA setup is offline; using any CPU\n",
+               xd->name, xd->dmaCpu);
+        xd->dmaCpu = -1;
+    }
+    atomic_set(&xd->mmapCount, 0);
+    atomic_set(&xd->pipeRefs, 1);
+    sema_init(&xd->semOpen, 1);
+    INIT_WORK(&xd->dma_work, dma_setup);
+
+    // Set up (but don't arm) interrupt watchdog; it learns the
+    // transfer times as events come in
+    hrtimer_init(&xd->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    xd->irq_timer.function = irq_timer_callback;
+    xd->wdTimeout = (u64) IRQ_TIMEOUT_MS * NSEC_PER_MSEC;
+    hrtimer_init(&xd->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    xd->poll_timer.function = xpcie_poll_timer;
+
+    return xd;
+}
+
+// Device-independent part of the probe, shared with the simulated endpoint
+int xpcie_setup(xpcie_dev *xd) {
+    
+    dev_t devnum = MKDEV(MAJOR(gDevNum), xd->minor);
+    struct device *device;
+    unsigned i;
+
+    // Create DMA workqueue.  Pinned to one CPU, a per-CPU workqueue
+    // with one work item in flight still runs the setup in order.
+    if (xd->dmaCpu >= 0)
+        xd->dma_setup_wq = alloc_workqueue("%s", WQ_MEM_RECLAIM, 1, xd->name);
+    else
+        xd->dma_setup_wq = create_singlethread_workqueue(xd->name);
+    if (xd->dma_setup_wq == NULL) {
+        printk(KERN_WARNING "%s: probe: couldn't create DMA workqueue\n", xd->name);
+        return (CRIT_ERR);
+    }
+    xd->statFlags = xd->statFlags | HAVE_WQ;
+
+    // Create event queue
+    if (!xpcie_ring_ok(gNevt, gEvtBufSize, gArenaBytes)) {
+        printk(KERN_WARNING "%s: probe: bad ring geometry %u x %u bytes (arena %u)\n", 
+               xd->name, gNevt, gEvtBufSize, gArenaBytes);
+        return (CRIT_ERR);
+    }
+    xd->evtQ = new_evtq(xd->pdev, gNevt, gEvtBufSize, gArenaBytes, gStreamingDma);
+    if (xd->evtQ == NULL) {
+        printk(KERN_ALERT "%s: Open: couldn't create event queue\n",xd->name);
+        return (CRIT_ERR);
+    }
+    
+    if (gSimMode)
+        xpcie_sim_set_maxbytes(&xd->sim, xd->evtQ->bufsize);
+
+    if (xpcie_set_overflow(xd, gOverflow) != SUCCESS)
+        printk(KERN_WARNING "%s: probe: can't use overflow policy %u; will block\n",
+               xd->name, gOverflow);
+    xd->freeRun = gFreeRun;
+    xd->freeOverflow = min(gFreeRunOverflow, XPCIE_OVF_NUM - 1U);
+
+    // Initialize card registers
+    xpcie_init_card(xd);
+
+    // Free-running: acquire from now on, reader or not.  Before the
+    // device can be opened, so the first reader finds it idle.
+    if (xd->freeRun)
+        xpcie_free_run_idle(xd);
+
+    //--- START: Register Driver
+    
+    // Register with the kernel as a character device.
+    // Last, since it can be opened as soon as it is there.
+    cdev_init(&xd->cdev, &xpcie_intf);
+    xd->cdev.owner = THIS_MODULE;
+    if (0 > cdev_add(&xd->cdev, devnum, 1)) {
+        printk(KERN_WARNING "%s: probe: will not register\n", xd->name);
+        return (CRIT_ERR);
+    }
+    PDEBUG("%s: probe: module registered\n", xd->name);
+    xd->statFlags = xd->statFlags | HAVE_KREG;
+
+    // Device file for udev: /dev/atri-pcieN
+    device = device_create(gClass, xd->pdev ? &xd->pdev->dev : NULL, devnum, xd, "%s", xd->name);
+    if (IS_ERR(device))
+        printk(KERN_WARNING "%s: probe: couldn't create device file\n", xd->name);
+    else {
+        xd->statFlags = xd->statFlags | HAVE_DEVICE;
+        xd->device = device;
+
+        // Link attributes in /sys/class/atri-pcie/atri-pcieN
+        for (i = 0; i < ARRAY_SIZE(xpcie_link_attrs); i++) {
+            if (device_create_file(device, xpcie_link_attrs[i]) < 0)
+                printk(KERN_WARNING "%s: probe: couldn't create sysfs attributes\n", xd->name);
+        }
+    }
+    
+    //--- END: Register Driver
+
+    // Statistics; not fatal if debugfs is missing
+    if (gDebugDir != NULL) {
+        xd->debugDir = debugfs_create_dir(xd->name, gDebugDir);
+        if (xd->debugDir != NULL)
+            debugfs_create_file("stats", S_IRUGO, xd->debugDir, xd, &xpcie_stats_fops);
+    }
+
+    printk(KERN_ALERT "%s: driver is loaded (device %d:%d)\n", xd->name,
+           MAJOR(devnum), MINOR(devnum));
+        
+    return SUCCESS;
+}
+
+// Performs any cleanup required before removing the device
+void xpcie_remove(struct pci_dev *dev) {
+    xpcie_teardown(pci_get_drvdata(dev));
+    pci_set_drvdata(dev, NULL);
+}
+
+// Release everything a board holds, however far its setup got
+void xpcie_teardown(xpcie_dev *xd) {
+
+    unsigned i;
+    unsigned long flags;
+
+    if (xd == NULL)
+        return;
+
+    // No more opens
+    if (xd->statFlags & HAVE_DEVICE) {
+        PDEBUG("%s: remove device file\n", xd->name);
+        for (i = 0; i < ARRAY_SIZE(xpcie_link_attrs); i++)
+            device_remove_file(xd->device, xpcie_link_attrs[i]);
+        device_destroy(gClass, MKDEV(MAJOR(gDevNum), xd->minor));
+    }
+    if (xd->statFlags & HAVE_KREG) {
+        PDEBUG("%s: unregister driver\n",xd->name);        
+        cdev_del(&xd->cdev);
+    }  
+    debugfs_remove_recursive(xd->debugDir);
+
+    // Set the abort flags, so nothing re-arms DMA.  The timers check
+    // them under the queue lock before queueing DMA setup.
+    if (xd->evtQ != NULL) {
+        spin_lock_irqsave(&xd->evtQ->lock, flags);
+        xd->readAbort = xd->die = 1;
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+    }
+    else
+        xd->readAbort = xd->die = 1;
+
+    // Stop the simulated endpoint
+    if (gSimMode)
+        xpcie_sim_remove(&xd->sim, xd->name);
+
+    // Wake up any sleeping DMA setup and reads and don't restart
+    if (xd->evtQ != NULL) {
+        PDEBUG("%s: empty event queue\n", xd->name);
+        xpcie_queue_flush(xd);
+    }
+        
+    // Flush the DMA workqueue and destroy it
+    if (xd->statFlags & HAVE_WQ) {
+        PDEBUG("%s: destroy workqueue\n", xd->name);        
+        flush_workqueue(xd->dma_setup_wq);
+        destroy_workqueue(xd->dma_setup_wq);
+    }
+    
+    // Check if we have a memory region and free it
+    if (xd->statFlags & HAVE_REGION) {
+        PDEBUG("%s: release memory\n",xd->name);        
+        release_mem_region(xd->baseHdwr, PCIE_REGISTER_SIZE);
+    }
+    
+    // Check if we have an IRQ and free it
+    if (xd->statFlags & HAVE_IRQ) {
+        PDEBUG("%s: free IRQ %d\n",xd->name, xd->pdev->irq);    
+        irq_set_affinity_hint(xd->pdev->irq, NULL);
+        free_irq(xd->pdev->irq, xd);
+        if (PCI_USE_MSI)
+            pci_disable_msi(xd->pdev);    
+    }
+
+    // Delete the interrupt and polling timers.  Only now: DMA setup
+    // and the interrupt handler arm them, and both are gone.  The
+    // watchdog may still touch the registers, so before the unmap.
+    hrtimer_cancel(&xd->irq_timer);
+    hrtimer_cancel(&xd->poll_timer);
+    
+    // Free up memory pointed to by virtual address
+    if (xd->baseVirt != NULL) {
+        PDEBUG("%s: unmap memory\n",xd->name);          
+        iounmap(xd->baseVirt);
+        xd->baseVirt = NULL;
+    }
+
+    if (xd->statFlags & HAVE_PCI)
+        pci_disable_device(xd->pdev);
+    xd->statFlags = 0;
+
+    // Pipes may still hold pages of the ring.  Don't wait on whoever
+    // holds the pipe; the last pipe buffer frees the ring instead, and
+    // the board keeps its minor number until then.  No new pipe
+    // buffers can appear once the count is down to the board's own.
+    if (atomic_read(&xd->pipeRefs) > 1) {
+        printk(KERN_INFO "%s: spliced pages still in pipes; ring freed once consumed\n",
+               xd->name);
+        xd->orphan = 1;
+        atomic_inc(&gOrphans);
+    }
+    
+    printk(KERN_ALERT "%s driver is unloaded\n", xd->name);
+    xpcie_put_dev(xd);
+}
+
+// Drop a reference to the board's memory: the board's own at
+// teardown, or a pipe buffer's.  The last one frees the ring and the
+// board.
+void xpcie_put_dev(xpcie_dev *xd) {
+
+    int orphan;
+
+    if (!atomic_dec_and_test(&xd->pipeRefs))
+        return;
+    orphan = xd->orphan;
+
+    // Release event queue memory
+    PDEBUG("%s: delete event queue structure\n",xd->name);
+    delete_evtq(xd->evtQ);
+
+    mutex_lock(&gDevsLock);
+    gDevs[xd->minor] = NULL;
+    mutex_unlock(&gDevsLock);
+    free_percpu(xd->stats);
+    kfree(xd);
+
+    // Module exit may be waiting for it; the RCU read side keeps the
+    // module's code around until the wakeup is done
+    if (orphan) {
+        rcu_read_lock();
+        if (atomic_dec_and_test(&gOrphans))
+            wake_up(&gOrphanWaitq);
+        rcu_read_unlock();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt handling and DMA setup
+//
+
+irq_handler_t xpcie_irq_handler(int irq, void *dev_id, struct pt_regs *regs) {
+
+    xpcie_dev *xd = dev_id;
+    unsigned long flags;
+    int idle;
+    int almost_full;
+    
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+
+    // The transfer in flight isn't done, so this interrupt is late,
+    // for a transfer the poller or the watchdog has already retired
+    if (xd->evtQ->dma_started && !xpcie_dma_wr_done(xd)) {
+        if (xd->pollArmed)
+            stats_inc(xd->stats, poll_stale);
+        else
+            stats_inc(xd->stats, irq_stale);
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+        return (irq_handler_t) IRQ_HANDLED;
+    }
+
+    // Disable the lost interrupt watchdog
+    hrtimer_try_to_cancel(&xd->irq_timer);
+    
+    PDEBUG("%s: Interrupt Handler Start ..",xd->name);
+
+    almost_full = xpcie_dma_complete(xd);
+    idle = !xd->evtQ->dma_started;
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+
+    xpcie_dma_wake(xd, almost_full, idle);
+    
+    PDEBUG("%s evt_queue: %u events\n", xd->name, evtq_entries(xd->evtQ));
+    PDEBUG("%s Interrupt Handler End ..\n", xd->name);
+
+    return (irq_handler_t) IRQ_HANDLED;
+}
+
+// After retiring a transfer, outside the lock: wake the reader, and
+// put the posting of more free slots into a workqueue.  It can sleep
+// so cannot be done here.  In threaded mode this is only needed when
+// the ring is full.
+void xpcie_dma_wake(xpcie_dev *xd, int almost_full, int idle) {
+
+    wake_up_interruptible(&xd->evtQ->rd_waitq);
+    if (almost_full)
+        kill_fasync(&xd->fasync, SIGIO, POLL_PRI);
+
+    if (!xd->die && !xd->dmaPause && (!gThreadedIrq || idle))
+        xpcie_queue_dma(xd);
+}
+
+// Retire the transfer that just finished and start the next one.
+// Call with the event queue lock held.  Returns 1 if the ring has
+// just become almost full.
+int xpcie_dma_complete(xpcie_dev *xd) {
+
+    unsigned int bytes;
+    int almost_full = 0;
+
+    if (!xd->die && xd->evtQ->dma_started) {
+        // Read out the actual transfer length and set in event.
+        // Data is now ready for processer. Increment the write pointer
+        // and wake up and waiting reads
+        bytes = xpcie_get_transfer_size(xd);
+        if (xd->evtQ->dma_scratch) {
+            // Ring was full: this one is dropped
+            evtq_drop_newest(xd->evtQ);
+            stats_inc(xd->stats, dropped_newest);
+        }
+        else {
+            evtq_sync_for_cpu(xd->evtQ, evtq_getevent(xd->evtQ, xd->evtQ->wr_idx),
+                              min((size_t) bytes, xd->evtQ->bufsize));
+            stats_dma_done(xd->stats, evtq_getevent(xd->evtQ, xd->evtQ->wr_idx), bytes,
+                           evtq_used(xd->evtQ) + 1, xd->evtQ->nevt);
+            trace_atri_dma_done(xd->minor, xd->evtQ->wr_idx, bytes);
+            evtq_commit(xd->evtQ, bytes);
+
+            // Early warning, once each time the ring fills up
+            if (evtq_used(xd->evtQ) == xd->evtQ->almost_full) {
+                stats_inc(xd->stats, almost_full);
+                almost_full = 1;
+            }
+        }
+        xd->xferCount++;
+        xd->rateCount++;
+        xpcie_wd_sample(xd, stats_now() - xd->wdArm);
+        xpcie_poll_check(xd);
+    }    
+    xd->evtQ->dma_started = 0;    
+
+    // Transfers complete in order, so if the next slot is
+    // already posted, start it right away.  In threaded and
+    // polled mode also post any free slots from here.
+    if (!xd->die && !xd->dmaPause) {
+        if (gThreadedIrq || xd->polling)
+            xpcie_dma_post(xd);
+        else if (evtq_posted(xd->evtQ))
+            xpcie_dma_arm(xd);
+    }
+    return almost_full;
+}
+
+// At the end of each rate window, switch to polling if completions
+// come faster than poll_enter_hz, and back to interrupts if they
+// drop below poll_exit_hz.  Call with the event queue lock held.
+void xpcie_poll_check(xpcie_dev *xd) {
+
+    u64 now = stats_now();
+    u64 rate;
+    unsigned int exit_hz = gPollExitHz ? gPollExitHz : gPollEnterHz / 2;
+
+    if (now - xd->rateStart < POLL_RATE_WINDOW_MS * NSEC_PER_MSEC)
+        return;
+    rate = div64_u64((u64) xd->rateCount * NSEC_PER_SEC, now - xd->rateStart);
+    xd->rateCount = 0;
+    xd->rateStart = now;
+
+    if (xd->die || xd->dmaPause)
+        return;
+
+    if (!xd->polling && gPollEnterHz && (rate >= gPollEnterHz)) {
+        xd->polling = 1;
+        stats_inc(xd->stats, poll_enter);
+        trace_atri_poll_mode(xd->minor, 1, rate);
+        if (!xd->pollTimerOn) {
+            xd->pollTimerOn = 1;
+            hrtimer_start(&xd->poll_timer, ns_to_ktime((u64) gPollUs * NSEC_PER_USEC),
+                          HRTIMER_MODE_REL);
+        }
+    }
+    else if (xd->polling && (!gPollEnterHz || (rate < exit_hz))) {
+        // The timer keeps running until any transfer armed
+        // without its interrupt has been retired
+        xd->polling = 0;
+        stats_inc(xd->stats, poll_exit);
+        trace_atri_poll_mode(xd->minor, 0, rate);
+    }
+}
+
+// Polling pass: retire finished transfers without an interrupt and
+// wake the reader once for all of them
+enum hrtimer_restart xpcie_poll_timer(struct hrtimer *t) {
+
+    xpcie_dev *xd = container_of(t, xpcie_dev, poll_timer);
+    unsigned long flags;
+    unsigned int n = 0;
+    int idle, restart;
+    int almost_full = 0;
+
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+    stats_inc(xd->stats, poll_passes);
+
+    // Each completion arms the next slot, so short events can
+    // finish within the same pass
+    while (xd->evtQ->dma_started && (n < max(gPollBudget, 1U)) && xpcie_dma_wr_done(xd)) {
+        hrtimer_try_to_cancel(&xd->irq_timer);
+        almost_full |= xpcie_dma_complete(xd);
+        n++;
+    }
+    if (n)
+        stats_add(xd->stats, poll_events, n);
+    else
+        xpcie_poll_check(xd);
+
+    idle = !xd->evtQ->dma_started;
+    restart = !xd->die && (xd->polling || (xd->evtQ->dma_started && xd->pollArmed));
+    if (!restart)
+        xd->pollTimerOn = 0;
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+
+    if (n) {
+        wake_up_interruptible(&xd->evtQ->rd_waitq);
+        if (almost_full)
+            kill_fasync(&xd->fasync, SIGIO, POLL_PRI);
+
+        // Ring is full: let DMA setup wait for the reader
+        if (!xd->die && !xd->dmaPause && idle)
+            xpcie_queue_dma(xd);
+    }
+
+    if (!restart)
+        return HRTIMER_NORESTART;
+    hrtimer_forward_now(t, ns_to_ktime((u64) gPollUs * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+void dma_setup(struct work_struct *work) {
+    xpcie_dev *xd = container_of(work, xpcie_dev, dma_work);
+    unsigned long flags;
+    u64 t_wait;
+    
+    PDEBUG("%s: DMA write setup\n", xd->name);
+
+    // This part is locked against the top half of the interrupt
+    // handler.  Otherwise we could send the wrong address.
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+
+    // Post and start what we can.  If the device is still idle,
+    // the queue is full: wait until it is not.
+    // If we're about to shutdown, don't go any further
+    while (!xd->die && !xd->dmaPause) {
+        xpcie_dma_post(xd);
+        if (xd->evtQ->dma_started)
+            break;
+
+        // but don't hold the lock
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+        trace_atri_ring_full(xd->minor, xd->evtQ->wr_idx, ACCESS_ONCE(xd->evtQ->rd_idx));
+        t_wait = stats_now();
+        wait_event_interruptible(xd->evtQ->wr_waitq, 
+                                 evtq_canarm(xd->evtQ) || xpcie_can_overflow(xd) ||
+                                 xd->die || xd->dmaPause);
+        stats_inc(xd->stats, wr_blocked);
+        stats_add(xd->stats, wr_blocked_ns, stats_now() - t_wait);
+        // Reaquire lock
+        spin_lock_irqsave(&xd->evtQ->lock, flags);
+    }
+    
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);    
+}
+
+// Post as many free slots as allowed and start the first posted
+// transfer if the device is idle.  Does not sleep; call with the
+// event queue lock held.
+void xpcie_dma_post(xpcie_dev *xd) {
+    unsigned depth = clamp(dma_depth, 1U, xd->evtQ->nevt);
+
+    while (evtq_canpost(xd->evtQ, depth))
+        xd->evtQ->dma_idx++;
+
+    // Ring full and nothing to arm: drop-oldest makes room
+    if (!xd->evtQ->dma_started && !evtq_posted(xd->evtQ) && xpcie_drop_oldest(xd))
+        xd->evtQ->dma_idx++;
+
+    PDEBUG("%s: %u slots posted\n", xd->name, evtq_posted(xd->evtQ));
+
+    // Drop-newest arms even with nothing posted
+    if (!xd->evtQ->dma_started && 
+        (evtq_posted(xd->evtQ) || (xd->overflow == XPCIE_OVF_DROP_NEWEST)))
+        xpcie_dma_arm(xd);
+}
+
+// Drop-oldest overflow: throw away the oldest unread event to make
+// room, unless the reader is busy with it.  Call with the event
+// queue lock held.
+int xpcie_drop_oldest(xpcie_dev *xd) {
+    int dropped = 0;
+
+    if ((xd->overflow != XPCIE_OVF_DROP_OLDEST) || !xpcie_hold(xd))
+        return 0;
+    if (evtq_avail(xd->evtQ) && !xpcie_spliced(xd) && !xpcie_ubuf_out(xd) &&
+        !xd->partial) {
+        evtq_drop_oldest(xd->evtQ);
+        stats_inc(xd->stats, dropped_oldest);
+        dropped = 1;
+    }
+    xpcie_unhold(xd);
+    return dropped;
+}
+
+// Could the overflow policy start a transfer into a full ring?
+int xpcie_can_overflow(xpcie_dev *xd) {
+    switch (xd->overflow) {
+    case XPCIE_OVF_DROP_OLDEST:
+        // Not while the reader, a pipe or a user buffer has the oldest
+        // event, or read() is partway through it
+        return !test_bit(XPCIE_CLAIM_READER, &xd->consumer) && !ACCESS_ONCE(xd->spliceHeld) &&
+            !atomic_read(&evtq_getevent(xd->evtQ, ACCESS_ONCE(xd->evtQ->rd_idx))->refs) &&
+            !xpcie_ubuf_out(xd) && !ACCESS_ONCE(xd->partial);
+    case XPCIE_OVF_DROP_NEWEST:
+        return (xd->evtQ->scratch.buf != NULL);
+    default:
+        return 0;
+    }
+}
+
+// Program the device with the oldest posted slot and start the DMA.
+// Does nothing if a packed queue has no room for the event yet.
+// Call with the event queue lock held.
+void xpcie_dma_arm(xpcie_dev *xd) {
+    evtbuf *eb;
+    u32 tlp_cnt;
+
+    // Drop-oldest may have to make room in a packed arena
+    while (evtq_posted(xd->evtQ) && !evtq_place(xd->evtQ)) {
+        if (!xpcie_drop_oldest(xd))
+            break;
+    }
+
+    // Transfer into the oldest posted slot; if the ring is full, into
+    // the scratch buffer with drop-newest
+    if (evtq_posted(xd->evtQ) && evtq_place(xd->evtQ)) {
+        eb = evtq_getevent(xd->evtQ, xd->evtQ->wr_idx);        
+        xd->evtQ->dma_scratch = 0;
+    }
+    else if ((xd->overflow == XPCIE_OVF_DROP_NEWEST) && (xd->evtQ->scratch.buf != NULL)) {
+        eb = &xd->evtQ->scratch;
+        xd->evtQ->dma_scratch = 1;
+    }
+    else {
+        PDEBUG("%s: no room in ring\n", xd->name);
+        return;
+    }
+
+    PDEBUG("%s: DMA is%s done\n", xd->name,
+                       xpcie_dma_wr_done(xd) ? "" : " NOT");
+
+    // Reset the initiator.  This also clears the DONE bit, which
+    // starting a transfer doesn't.  The poller and the stale interrupt
+    // check take DONE to mean the transfer in flight has finished, so
+    // it must not be left over from the one before.
+    xpcie_initiator_reset(xd);
+    
+    // The device owns the buffer until the transfer completes
+    evtq_sync_for_device(xd->evtQ, eb, xd->evtQ->bufsize);
+
+    // Write the PCIe write DMA address to the device
+    xpcie_write_reg(xd, REG_WDMATLPA, eb->physaddr);
+
+    // For testing with Xilinx XAPP1052 firmware
+    if (XILINX_TEST_MODE) {
+        // Write: Write DMA Expected Data Pattern with default value
+        xpcie_write_reg(xd, REG_WDMATLPP, xd->xferCount);
+        // Write: Write DMA TLP Size register (max payload size)
+        xpcie_write_reg(xd, REG_WDMATLPS, xd->tlpDwords);
+        // Write: Write DMA TLP Count register (randomize, within the slot!)
+        get_random_bytes(&tlp_cnt, 4);
+        xpcie_write_reg(xd, REG_WDMATLPC, 
+                        (tlp_cnt % max_t(size_t, xd->evtQ->bufsize / (xd->tlpDwords*4), 1))+1);
+    }
+    else {
+        // Overloaded: additional waiting time for transfer start: 
+        // nwords(16 downto 0) + ('0' & nwords(16 downto 0)) - REG_RDMATLPP
+        xpcie_write_reg(xd, REG_RDMATLPP, 0);
+    }    
+    mmiowb();
+
+    // Tell the device to start DMA
+    eb->t_arm = stats_now();
+    trace_atri_dma_arm(xd->minor, xd->evtQ->wr_idx, eb->physaddr);
+    // When polling, the transfer completes without an interrupt
+    xd->pollArmed = xd->polling;
+    xpcie_write_reg(xd, REG_DDMACR, DDMACR_WR_START | (xd->pollArmed ? DDMACR_WR_INTDIS : 0));
+    mmiowb();
+
+    // Record that we've started a DMA
+    xd->evtQ->dma_started = 1;
+
+    // Set up the watchdog in case we lose the interrupt
+    xd->wdArm = eb->t_arm;
+    xd->wdNext = xd->wdTimeout;
+    hrtimer_start(&xd->irq_timer, ns_to_ktime(xd->wdNext), HRTIMER_MODE_REL);
+}
+
+// Stop arming DMA and abort any transfer in progress, so that the ring
+// can be changed underneath the device.  Unread events are kept.
+void xpcie_dma_quiesce(xpcie_dev *xd) {
+
+    unsigned long flags;
+
+    xd->dmaPause = 1;
+    wake_up_interruptible(&xd->evtQ->wr_waitq);
+    flush_workqueue(xd->dma_setup_wq);
+    hrtimer_cancel(&xd->irq_timer);
+
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+    if (xd->evtQ->dma_started) {
+        xpcie_initiator_reset(xd);
+        xd->evtQ->dma_started = 0;
+    }
+    xd->evtQ->dma_idx = xd->evtQ->wr_idx;
+    xd->polling = xd->pollArmed = 0;
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+
+    // Let a completion that raced with the reset finish, so nothing
+    // writes into the ring once it's changed
+    if (xd->pdev != NULL)
+        synchronize_irq(xd->pdev->irq);
+    if (gSimMode)
+        xpcie_sim_sync(&xd->sim);
+    hrtimer_cancel(&xd->poll_timer);
+    xd->pollTimerOn = 0;
+}
+
+void xpcie_dma_resume(xpcie_dev *xd) {
+    xd->dmaPause = 0;
+    xpcie_queue_dma(xd);
+}
+
+// Run DMA setup, on the chosen CPU if there is one.  Not once
+// teardown has started: the workqueue may be gone.
+void xpcie_queue_dma(xpcie_dev *xd) {
+    if (xd->die)
+        return;
+    if (xd->dmaCpu >= 0)
+        queue_work_on(xd->dmaCpu, xd->dma_setup_wq, &xd->dma_work);
+    else
+        queue_work(xd->dma_setup_wq, &xd->dma_work);
+}
+
+//
+// xpcie_ring_size: report the ring geometry and, if a new one is
+// given, reallocate the ring.  Buffered events are discarded.
+//
+long xpcie_ring_size(struct file *filp, xpcie_ringsize __user *ursz) {
+
+    xpcie_dev *xd = filp->private_data;
+    xpcie_ringsize rsz;
+    long ret = SUCCESS;
+
+    if (copy_from_user(&rsz, ursz, sizeof(rsz)))
+        return -EFAULT;
+
+    if (rsz.nevt || rsz.bufsize) {
+        if (!xpcie_ring_ok(rsz.nevt, rsz.bufsize, rsz.arena_bytes))
+            return -EINVAL;
+
+        // Can't pull the buffers out from under a mapping; mmap()
+        // claims the ring too, so none can appear meanwhile
+        if (xpcie_claim(xd))
+            return -EBUSY;
+        if (xpcie_spliced(xd) || atomic_read(&xd->mmapCount)) {
+            xpcie_unclaim(xd);
+            return -EBUSY;
+        }
+
+        xpcie_dma_quiesce(xd);
+        ret = evtq_alloc(xd->evtQ, rsz.nevt, rsz.bufsize, rsz.arena_bytes);
+        if (gSimMode)
+            xpcie_sim_set_maxbytes(&xd->sim, xd->evtQ->bufsize);
+        filp->f_pos = 0;
+        xd->partial = 0;
+        xpcie_dma_resume(xd);
+        xpcie_unclaim(xd);
+
+        if (ret == SUCCESS)
+            printk(KERN_INFO "%s: ring resized to %u x %u bytes (arena %u)\n",
+                   xd->name, rsz.nevt, rsz.bufsize, rsz.arena_bytes);
+    }
+
+    rsz.nevt = xd->evtQ->nevt;
+    rsz.bufsize = xd->evtQ->bufsize;
+    rsz.arena_bytes = xd->evtQ->packed ? xd->evtQ->arena_size : 0;
+    if (copy_to_user(ursz, &rsz, sizeof(rsz)))
+        return -EFAULT;
+    return ret;
+}
+
+//
+// xpcie_set_userbuf: make the user's buffer pool the ring, so the
+// device writes events straight into it, or with nbuf = 0 go back to
+// the driver's own buffers.  Buffered events are discarded.
+//
+long xpcie_set_userbuf(struct file *filp, xpcie_userbuf *ub) {
+
+    xpcie_dev *xd = filp->private_data;
+    long ret;
+
+    if (ub->nbuf && !xpcie_ring_ok(ub->nbuf, ub->bufsize, 0))
+        return -EINVAL;
+
+    // Can't pull the buffers out from under a mapping; mmap()
+    // claims the ring too, so none can appear meanwhile
+    if (xpcie_claim(xd))
+        return -EBUSY;
+    if (xpcie_spliced(xd) || atomic_read(&xd->mmapCount)) {
+        xpcie_unclaim(xd);
+        return -EBUSY;
+    }
+
+    xpcie_dma_quiesce(xd);
+    if (ub->nbuf)
+        ret = evtq_alloc_user(xd->evtQ, (unsigned long) ub->addr, ub->nbuf, ub->bufsize);
+    else
+        ret = evtq_alloc(xd->evtQ, gNevt, gEvtBufSize, gArenaBytes);
+    if (gSimMode)
+        xpcie_sim_set_maxbytes(&xd->sim, xd->evtQ->bufsize);
+    xd->ubufNext = xd->evtQ->rd_idx;
+    filp->f_pos = 0;
+    xd->partial = 0;
+    xpcie_dma_resume(xd);
+    xpcie_unclaim(xd);
+
+    if ((ret == SUCCESS) && ub->nbuf)
+        printk(KERN_INFO "%s: DMA into %u user buffers of %u bytes\n",
+               xd->name, ub->nbuf, ub->bufsize);
+    return ret;
+}
+
+long xpcie_userbuf_ioctl(struct file *filp, xpcie_userbuf __user *uub) {
+    xpcie_userbuf ub;
+
+    if (copy_from_user(&ub, uub, sizeof(ub)))
+        return -EFAULT;
+    return xpcie_set_userbuf(filp, &ub);
+}
+
+// Has the user buffer at the head of the ring been handed out?
+int xpcie_ubuf_out(xpcie_dev *xd) {
+    return (xd->evtQ->upages != NULL) &&
+        ((int)(ACCESS_ONCE(xd->ubufNext) - ACCESS_ONCE(xd->evtQ->rd_idx)) > 0);
+}
+
+//
+// xpcie_userbuf_next: wait for the next filled user buffer and say
+// which one it is.  It stays the reader's until released.
+//
+long xpcie_userbuf_next(struct file *filp, xpcie_ubuf_evt __user *uevt) {
+
+    xpcie_dev *xd = filp->private_data;
+    xpcie_ubuf_evt ue;
+    evtbuf *eb;
+
+    if (xd->evtQ->upages == NULL)
+        return -EINVAL;
+    if (xpcie_claim(xd))
+        return -EBUSY;
+
+    for (;;) {
+        // Buffers handed out may have been released or flushed since
+        if ((int)(xd->ubufNext - xd->evtQ->rd_idx) < 0)
+            xd->ubufNext = xd->evtQ->rd_idx;
+        if ((evtq_load_acquire(&xd->evtQ->wr_idx) != xd->ubufNext) || xd->readAbort)
+            break;
+        xpcie_unclaim(xd);
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(xd->evtQ->rd_waitq, 
+                                     (ACCESS_ONCE(xd->evtQ->wr_idx) != xd->ubufNext) ||
+                                     xd->readAbort))
+            return -ERESTARTSYS; /* signal caught */
+        if (xpcie_claim(xd))
+            return -EBUSY;
+    }
+
+    if (xd->readAbort) {
+        xpcie_unclaim(xd);
+        return -EPIPE;
+    }
+
+    eb = evtq_getevent(xd->evtQ, xd->ubufNext);
+    ue.index = xd->ubufNext;
+    ue.len = eb->len;
+    ue.seq = eb->seq;
+    ue.t_arm = eb->t_arm;
+    ue.t_done = eb->t_done;
+    xd->ubufNext++;
+    xpcie_unclaim(xd);
+
+    if (copy_to_user(uevt, &ue, sizeof(ue)))
+        return -EFAULT;
+    return SUCCESS;
+}
+
+//
+// Lost-interrupt watchdog, started with each transfer.  A transfer
+// found done means its interrupt was lost: complete it now.  One not
+// done is most likely waiting for the ATRI to send an event, so check
+// again, backing off, and only reset the initiator once it has been
+// stuck for IRQ_TIMEOUT_MS.
+//
+enum hrtimer_restart irq_timer_callback(struct hrtimer *t) {
+
+    xpcie_dev *xd = container_of(t, xpcie_dev, irq_timer);
+    unsigned long flags;
+    u64 waited, limit = (u64) IRQ_TIMEOUT_MS * NSEC_PER_MSEC;
+    int almost_full, idle;
+    
+    spin_lock_irqsave(&xd->evtQ->lock, flags);
+
+    // The transfer completed and the next one re-armed us while we
+    // waited for the lock.  That one has its own expiry, so leave it;
+    // forwarding an enqueued timer would corrupt it.
+    if (hrtimer_is_queued(t)) {
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    waited = stats_now() - xd->wdArm;
+    
+    // Did we somehow forget to set up a transfer?  
+    if (!(xd->evtQ->dma_started)) {
+        printk(KERN_WARNING "%s: irq timeout: setting up another transfer.\n",xd->name);
+        stats_inc(xd->stats, timeouts[STATS_TMO_REARM]);
+        trace_atri_irq_timeout(xd->minor, STATS_TMO_REARM);
+        xpcie_queue_dma(xd);
+    }
+    // If we started a transfer but just never got the interrupt,
+    // check to see if it's done
+    else if (xpcie_dma_wr_done(xd)) {
+        // A transfer armed for polling has no interrupt to lose; the
+        // poller just hasn't got to it yet, so don't count it as lost
+        if (!xd->pollArmed) {
+            printk(KERN_WARNING "%s: irq timeout: DMA done after %llu us; force call to handler.\n",
+                   xd->name, div_u64(waited, NSEC_PER_USEC));
+            stats_inc(xd->stats, timeouts[STATS_TMO_FORCED]);
+            if (waited < limit)
+                stats_add(xd->stats, wd_saved_ns, limit - waited);
+            trace_atri_irq_timeout(xd->minor, STATS_TMO_FORCED);
+        }
+        // Complete it ourselves, still under the lock: once it's
+        // dropped, a late interrupt may retire this transfer and arm
+        // the next, which must not be completed in its place.  The
+        // late interrupt finds the next one not done and ignores it.
+        almost_full = xpcie_dma_complete(xd);
+        idle = !xd->evtQ->dma_started;
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+        xpcie_dma_wake(xd, almost_full, idle);
+        return HRTIMER_NORESTART;
+    }
+    else if (waited < limit) {
+        // Still waiting for data; look again later
+        stats_inc(xd->stats, wd_checks);
+        xd->wdNext = min(xd->wdNext * 2, limit - waited);
+        hrtimer_forward_now(t, ns_to_ktime(xd->wdNext));
+        spin_unlock_irqrestore(&xd->evtQ->lock, flags);
+        return HRTIMER_RESTART;
+    }
+    else {
+        // DMA was started but is not done.  That is probably bad.
+        printk(KERN_WARNING "%s: no IRQ in %d ms!\n",xd->name, IRQ_TIMEOUT_MS);
+        printk(KERN_WARNING "%s: irq timeout: DMA started but not done; trying again.\n",xd->name);
+        stats_inc(xd->stats, timeouts[STATS_TMO_RESET]);
+        trace_atri_irq_timeout(xd->minor, STATS_TMO_RESET);
+        xd->evtQ->dma_started = 0;            
+        xpcie_initiator_reset(xd);
+        xpcie_queue_dma(xd);
+    }
+
+    spin_unlock_irqrestore(&xd->evtQ->lock, flags);    
+
+    return HRTIMER_NORESTART;
+}
+
+// Feed one arm-to-completion time to the watchdog.  Every WD_WINDOW
+// transfers, its first check moves to wd_mult times their p99, within
+// wd_min_us and IRQ_TIMEOUT_MS.  Call with the event queue lock held.
+void xpcie_wd_sample(xpcie_dev *xd, u64 ns) {
+
+    unsigned int i, n = 0;
+    u64 p99;
+
+    xd->wdHist[stats_lat_bin(ns)]++;
+    if (++xd->wdCount < WD_WINDOW)
+        return;
+
+    // Upper edge of the bin the 99th percentile falls in
+    for (i = 0; i < STATS_LAT_BINS - 1; i++) {
+        n += xd->wdHist[i];
+        if (n * 100 >= xd->wdCount * 99)
+            break;
+    }
+    p99 = (1ULL << i) * NSEC_PER_USEC;
+    xd->wdTimeout = clamp_t(u64, p99 * max(gWdMult, 1U), (u64) gWdMinUs * NSEC_PER_USEC,
+                            (u64) IRQ_TIMEOUT_MS * NSEC_PER_MSEC);
+    memset(xd->wdHist, 0, sizeof(xd->wdHist));
+    xd->wdCount = 0;
+}
+
+// Queue flush.  This is a consumer operation: call with the
+// consumer side claimed, or when there is no reader.
+void xpcie_queue_flush(xpcie_dev *xd) {
+
+    // Empty the event queue, including anything still in a pipe
+    empty_evtq(xd->evtQ);
+    xd->spliceHeld = 0;
+    xd->partial = 0;
+    stats_inc(xd->stats, flushes);
+
+    // Wake up stuff that was waiting
+    wake_up_interruptible(&xd->evtQ->wr_waitq);
+    wake_up_interruptible(&xd->evtQ->rd_waitq);
+    
+    return;
 }
 
 //-----------------------------------------------------------------------------
 // Device control functions
 
-//--- xpcie_initiator_reset(): Resets the Xilinx reference design
-void xpcie_initiator_reset() {
+//--- xpcie_initiator_reset(xd): Resets the Xilinx reference design
+void xpcie_initiator_reset(xpcie_dev *xd) {
   // Reset device and then make it active
-  xpcie_write_reg(REG_DCSR, DCSR_RESET);
+  xpcie_write_reg(xd, REG_DCSR, DCSR_RESET);
   mmiowb();
-  xpcie_write_reg(REG_DCSR, DCSR_ACTIVE);
+  xpcie_write_reg(xd, REG_DCSR, DCSR_ACTIVE);
   mmiowb();
 }
 
-//--- xpcie_init_card(): Initializes XBMD descriptor registers to default values
-void xpcie_init_card() {
-  xpcie_initiator_reset();
+//--- xpcie_init_card(xd): Initializes XBMD descriptor registers to default values
+void xpcie_init_card(xpcie_dev *xd) {
+  xpcie_initiator_reset(xd);
 }
 
-void xpcie_dump_regs(void) {
+void xpcie_dump_regs(xpcie_dev *xd) {
     u32 i, regx;
     for (i = 0; i < 13; i++) {
-        regx = xpcie_read_reg(i);
-        printk(KERN_WARNING "%s : REG<%d> : 0x%X\n", gDrvrName, i, regx);
+        regx = xpcie_read_reg(xd, i);
+        printk(KERN_WARNING "%s : REG<%d> : 0x%X\n", xd->name, i, regx);
     }    
 }
 
-u32 xpcie_read_reg(u32 dw_offset) {
+u32 xpcie_read_reg(xpcie_dev *xd, u32 dw_offset) {
     u32 ret = 0;
-    ret = readl(gBaseVirt + (4 * dw_offset));
-    PDEBUG("%s Read Register %d Value %x\n", gDrvrName, dw_offset, ret);    
+    if (gSimMode)
+        ret = xpcie_sim_read_reg(&xd->sim, dw_offset);
+    else
+        ret = readl(xd->baseVirt + (4 * dw_offset));
+    PDEBUG("%s Read Register %d Value %x\n", xd->name, dw_offset, ret);    
     return ret; 
 }
 
-void xpcie_write_reg(u32 dw_offset, u32 val) {
-	PDEBUG("%s Write Register %d Value %x\n", gDrvrName,
+void xpcie_write_reg(xpcie_dev *xd, u32 dw_offset, u32 val) {
+	PDEBUG("%s Write Register %d Value %x\n", xd->name,
                        dw_offset, val);  
-    writel(val, (gBaseVirt + (4 * dw_offset)));
+    if (gSimMode)
+        xpcie_sim_write_reg(&xd->sim, dw_offset, val);
+    else
+        writel(val, (xd->baseVirt + (4 * dw_offset)));
 }
 
-unsigned int xpcie_get_transfer_size(void) {
+unsigned int xpcie_get_transfer_size(xpcie_dev *xd) {
     u32 tlp_size, tlp_cnt, tlp_hw_cnt;
     u32 bytes;
-    tlp_size = xpcie_read_reg(REG_WDMATLPS) & DMA_TLP_SIZE_MASK;
-    tlp_cnt = xpcie_read_reg(REG_WDMATLPC) & DMA_TLP_CNT_MASK;
+    tlp_size = xpcie_read_reg(xd, REG_WDMATLPS) & DMA_TLP_SIZE_MASK;
+    tlp_cnt = xpcie_read_reg(xd, REG_WDMATLPC) & DMA_TLP_CNT_MASK;
     if (XILINX_TEST_MODE) {
         bytes = (tlp_size*tlp_cnt*4);
     }
     else {
-        tlp_hw_cnt = xpcie_read_reg(REG_WDMATLPEX);
+        tlp_hw_cnt = xpcie_read_reg(xd, REG_WDMATLPEX);
         bytes = tlp_hw_cnt*2;
         PDEBUG("%s transfer size %u B (%u halfwords)\n",
-               gDrvrName, bytes, tlp_hw_cnt);
+               xd->name, bytes, tlp_hw_cnt);
     }
     return bytes;
 }
 
-int xpcie_dma_wr_done(void) {
-    return (xpcie_read_reg(REG_DDMACR) & DDMACR_WR_DONE);
+int xpcie_dma_wr_done(xpcie_dev *xd) {
+    return (xpcie_read_reg(xd, REG_DDMACR) & DDMACR_WR_DONE);
+}
+
+//
+// xpcie_link_probe: find out what the link trained to and which
+// transaction sizes the endpoint was given, and size TLPs to match.
+// A link below the endpoint's capability (a narrow slot, a bad
+// cable) gets a warning, since it caps the event rate.
+//
+void xpcie_link_probe(xpcie_dev *xd) {
+
+    int pos;
+    u16 lnksta;
+    u32 lnkcap;
+
+    pos = pci_pcie_cap(xd->pdev);
+    if (pos == 0) {
+        printk(KERN_WARNING "%s: probe: no PCI Express capability\n", xd->name);
+        return;
+    }
+    pci_read_config_word(xd->pdev, pos + PCI_EXP_LNKSTA, &lnksta);
+    pci_read_config_dword(xd->pdev, pos + PCI_EXP_LNKCAP, &lnkcap);
+    xd->linkSpeed = lnksta & PCI_EXP_LNKSTA_CLS;
+    xd->linkWidth = (lnksta & PCI_EXP_LNKSTA_NLW) >> 4;
+    xd->maxLinkSpeed = lnkcap & PCI_EXP_LNKCAP_SLS;
+    xd->maxLinkWidth = (lnkcap & PCI_EXP_LNKCAP_MLW) >> 4;
+    xd->mps = pcie_get_mps(xd->pdev);
+    xd->mrrs = pcie_get_readrq(xd->pdev);
+
+    // The firmware's view of the transaction sizes
+    xd->tlpStat = xpcie_read_reg(xd, REG_DLTRSSTAT);
+    if (DLTRSSTAT_MPS(xd->tlpStat) != xd->mps)
+        printk(KERN_WARNING "%s: probe: firmware max payload %d bytes, link %d bytes\n",
+               xd->name, DLTRSSTAT_MPS(xd->tlpStat), xd->mps);
+
+    // Biggest TLPs the link takes; fewer TLPs means less header overhead
+    if (xd->mps > 0)
+        xd->tlpDwords = min(xd->mps, DLTRSSTAT_MPS(xd->tlpStat)) / 4;
+
+    printk(KERN_INFO "%s: PCIe link %s x%d, max payload %d, max read request %d bytes\n",
+           xd->name, xpcie_link_speed(xd->linkSpeed), xd->linkWidth, xd->mps, xd->mrrs);
+    if ((xd->linkSpeed < xd->maxLinkSpeed) || (xd->linkWidth < xd->maxLinkWidth))
+        printk(KERN_WARNING "%s: PCIe link degraded; endpoint supports %s x%d\n",
+               xd->name, xpcie_link_speed(xd->maxLinkSpeed), xd->maxLinkWidth);
+}
+
+//
+// xpcie_irq_affinity: steer the interrupt to the chosen CPU, or else
+// to the CPUs on the board's NUMA node, so that completions run next
+// to the ring memory.  It is only a hint, for irqbalance and the like.
+//
+void xpcie_irq_affinity(xpcie_dev *xd) {
+
+    int node = dev_to_node(&xd->pdev->dev);
+
+    if ((xd->irqCpu >= 0) && cpu_online(xd->irqCpu))
+        irq_set_affinity_hint(xd->pdev->irq, cpumask_of(xd->irqCpu));
+    else if (node != NUMA_NO_NODE)
+        irq_set_affinity_hint(xd->pdev->irq, cpumask_of_node(node));
+    PDEBUG("%s: IRQ %d on node %d, CPU %d\n", xd->name, xd->pdev->irq, node, xd->irqCpu);
+}
+
+//
+// xpcie_local_cpus: tell the reader where the board is, so that it can
+// pin itself to the CPUs next to it.
+//
+long xpcie_local_cpus(xpcie_dev *xd, xpcie_cpus __user *ucpus) {
+
+    xpcie_cpus cpus;
+    const struct cpumask *mask;
+    int cpu;
+
+    memset(&cpus, 0, sizeof(cpus));
+    cpus.node = xd->pdev ? dev_to_node(&xd->pdev->dev) : NUMA_NO_NODE;
+    cpus.irq_cpu = xd->irqCpu;
+    cpus.dma_cpu = xd->dmaCpu;
+    mask = (cpus.node != NUMA_NO_NODE) ? cpumask_of_node(cpus.node) : cpu_online_mask;
+    for_each_cpu(cpu, mask) {
+        if (cpu < XPCIE_CPUMASK_WORDS * 64)
+            cpus.mask[cpu / 64] |= 1ULL << (cpu % 64);
+    }
+
+    if (copy_to_user(ucpus, &cpus, sizeof(cpus)))
+        return -EFAULT;
+    return SUCCESS;
+}
+
+const char *xpcie_link_speed(int speed) {
+    switch (speed) {
+    case 1: return "2.5 GT/s";
+    case 2: return "5 GT/s";
+    case 3: return "8 GT/s";
+    default: return "unknown";
+    }
+}
+
+// Start the test-pattern transfer set up in the registers and wait for
+// it with its interrupt disabled.  Returns how long it took, or 0 if
+// it didn't finish.
+u64 xpcie_selftest_xfer(xpcie_dev *xd, int rd) {
+    u32 done = rd ? DDMACR_RD_DONE : DDMACR_WR_DONE;
+    u64 t0, t;
+
+    t0 = stats_now();
+    xpcie_write_reg(xd, REG_DDMACR, rd ? (DDMACR_RD_START | DDMACR_RD_INTDIS) :
+                                         (DDMACR_WR_START | DDMACR_WR_INTDIS));
+    mmiowb();
+    do {
+        if (xpcie_read_reg(xd, REG_DDMACR) & done)
+            return max_t(u64, stats_now() - t0, 1);
+        cpu_relax();
+        t = stats_now();
+    } while (t - t0 < SELFTEST_TIMEOUT_US * NSEC_PER_USEC);
+    return 0;
+}
+
+//
+// xpcie_run_selftest: run test-pattern write (and read) DMA transfers of a
+// chosen TLP size and count through the XAPP1052 registers, check the
+// data and time each transfer.  Needs the XAPP1052 test firmware;
+// event acquisition is paused meanwhile.
+//
+long xpcie_run_selftest(struct file *filp, xpcie_selftest __user *ust) {
+
+    xpcie_dev *xd = filp->private_data;
+    xpcie_selftest st;
+    xpcie_selftest_res *res;
+    dma_addr_t physaddr;
+    size_t bytes, j;
+    u32 *buf;
+    u64 ns;
+    unsigned i;
+    int rd, bad;
+    long ret = SUCCESS;
+
+    if (copy_from_user(&st, ust, sizeof(st)))
+        return -EFAULT;
+
+    // The simulated endpoint has no test-pattern engine
+    if (gSimMode)
+        return -EOPNOTSUPP;
+
+    // TLPs can't be bigger than the link's max payload size
+    if (st.tlp_dwords == 0)
+        st.tlp_dwords = xd->tlpDwords;
+    if ((st.ntransfers == 0) ||
+        (st.tlp_dwords > DMA_TLP_SIZE_MASK) ||
+        ((xd->mps > 0) && (st.tlp_dwords * 4 > xd->mps)) ||
+        (st.tlp_count == 0) || (st.tlp_count > DMA_TLP_CNT_MASK))
+        return -EINVAL;
+    bytes = (size_t) st.tlp_dwords * 4 * st.tlp_count;
+    if (bytes > BUF_SIZE)
+        return -EINVAL;
+
+    // Coherent, since read DMA goes the other way from the ring
+    buf = (u32 *) pci_alloc_consistent(xd->pdev, bytes, &physaddr);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    if (xpcie_claim(xd)) {
+        pci_free_consistent(xd->pdev, bytes, buf, physaddr);
+        return -EBUSY;
+    }
+    xpcie_dma_quiesce(xd);
+
+    memset(&st.wr, 0, sizeof(st.wr));
+    memset(&st.rd, 0, sizeof(st.rd));
+    for (rd = 0; rd <= !!(st.flags & XPCIE_SELFTEST_READ); rd++) {
+        res = rd ? &st.rd : &st.wr;
+        for (i = 0; i < st.ntransfers; i++) {
+            // Write DMA has to overwrite all of the buffer; read DMA
+            // reads the pattern from it
+            for (j = 0; j < bytes/4; j++)
+                buf[j] = rd ? st.pattern : ~st.pattern;
+            wmb();
+
+            xpcie_initiator_reset(xd);
+            if (rd) {
+                xpcie_write_reg(xd, REG_RDMATLPA, physaddr);
+                xpcie_write_reg(xd, REG_RDMATLPS, st.tlp_dwords);
+                xpcie_write_reg(xd, REG_RDMATLPC, st.tlp_count);
+                xpcie_write_reg(xd, REG_RDMATLPP, st.pattern);
+            }
+            else {
+                xpcie_write_reg(xd, REG_WDMATLPA, physaddr);
+                xpcie_write_reg(xd, REG_WDMATLPS, st.tlp_dwords);
+                xpcie_write_reg(xd, REG_WDMATLPC, st.tlp_count);
+                xpcie_write_reg(xd, REG_WDMATLPP, st.pattern);
+            }
+            mmiowb();
+
+            ns = xpcie_selftest_xfer(xd, rd);
+            if (ns == 0)
+                bad = 1;
+            else if (rd)
+                bad = xpcie_read_reg(xd, REG_RDMASTAT) & RDMASTAT_MISMATCH;
+            else {
+                rmb();
+                for (j = 0; (j < bytes/4) && (buf[j] == st.pattern); j++)
+                    ;
+                bad = (j < bytes/4);
+            }
+
+            if (bad)
+                res->errors++;
+            else {
+                res->done++;
+                res->bytes += bytes;
+                res->ns += ns;
+                if ((res->min_ns == 0) || (ns < res->min_ns))
+                    res->min_ns = ns;
+                res->max_ns = max(res->max_ns, ns);
+            }
+
+            cond_resched();
+            if (signal_pending(current)) {
+                ret = -EINTR;
+                goto done;
+            }
+        }
+        printk(KERN_INFO "%s: self-test %s DMA: %u/%u good, %llu MB/s, %llu-%llu ns\n",
+               xd->name, rd ? "read" : "write", res->done, st.ntransfers,
+               res->ns ? div64_u64(res->bytes * 1000, res->ns) : 0,
+               res->min_ns, res->max_ns);
+    }
+
+ done:
+    // Back to event acquisition
+    xpcie_init_card(xd);
+    xpcie_dma_resume(xd);
+    xpcie_unclaim(xd);
+    pci_free_consistent(xd->pdev, bytes, buf, physaddr);
+
+    if (copy_to_user(ust, &st, sizeof(st)))
+        return -EFAULT;
+    return ret;
+}
+
+// Ring geometry: a power of two number of slots, each holding a
+// whole number of halfwords and no larger than a DMA buffer.  A
+// packed arena must hold at least one full-size event.
+int xpcie_ring_ok(unsigned nevt, unsigned bufsize, unsigned arena_bytes) {
+    return (is_power_of_2(nevt) && (nevt <= NEVT_MAX) &&
+            (bufsize > 0) && (bufsize <= BUF_SIZE) && !(bufsize & 1) &&
+            ((arena_bytes == 0) || (arena_bytes >= bufsize)));
 }
 
 module_init(xpcie_init);
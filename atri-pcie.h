@@ -21,21 +21,41 @@
 // Registers on the firmware side (8 dwords)
 #define PCIE_REGISTER_SIZE        (4*8)
 
-// PCI DMA mask -- just use 32 bits
-// device can actually support more
-#define PCI_HW_DMA_MASK           0xffffffff
+// Most boards (device minors) handled by one driver
+#define XPCIE_MAX_DEVS            8
+
+// PCI DMA address bits.  The endpoint could address more, but the
+// write DMA address register (REG_WDMATLPA) is only 32 bits wide.
+#define PCI_HW_DMA_BITS           32
 
 // Use MSI or normal shared interrupts?
 // WARNING: legacy interrupt handling is broken still
 #define PCI_USE_MSI               1
 
-// Timer duration for lost interrupt (ms)
+// Longest a transfer may stay unfinished before the initiator is
+// reset (ms).  Lost interrupts are caught sooner by the watchdog.
 #define IRQ_TIMEOUT_MS            5000
 
+// Transfers per watchdog p99 estimate
+#define WD_WINDOW                 256
+
+// Window over which the completion rate is measured to switch
+// between interrupts and polling (ms)
+#define POLL_RATE_WINDOW_MS       10
+
+// Longest a reader may busy-poll for an event before sleeping (us)
+#define BUSY_POLL_MAX_US          10000
+
 // Xilinx XAPP1052 firmware test; driver sets up
 // transfer itself using a test pattern
 #define XILINX_TEST_MODE          0
 
+// TLP payload when the link can't be asked (simulated endpoint), in dwords
+#define TLP_DWORDS_DEFAULT        32
+
+// Self-test: longest wait for one test-pattern transfer (us)
+#define SELFTEST_TIMEOUT_US       100000
+
 // Register definitions (Xilinx)
 #define REG_DCSR       0  // Device Control Status Register
 #define REG_DDMACR     1  // Device DMA Control Register
@@ -63,6 +83,13 @@
 #define DDMACR_RD_INTDIS (1 << 23 )
 #define DDMACR_RD_DONE   (1 << 24 )
 
+#define RDMASTAT_MISMATCH 1   // read DMA data didn't match the expected pattern
+
+// REG_DLTRSSTAT fields, encoded as 128 << n bytes like the PCIe registers
+#define DLTRSSTAT_MPS_CAP(x)  (128 << ((x) & 0x7))          // largest payload supported
+#define DLTRSSTAT_MPS(x)      (128 << (((x) >> 8) & 0x7))   // payload size programmed
+#define DLTRSSTAT_MRRS(x)     (128 << (((x) >> 16) & 0x7))  // max read request size
+
 #define DMA_TLP_SIZE_MASK 0x1fff
 #define DMA_TLP_CNT_MASK  0xffff
 
@@ -71,14 +98,151 @@
 #define HAVE_IRQ    0x02                    // Interupt
 #define HAVE_KREG   0x04                    // Kernel registration
 #define HAVE_WQ     0x08                    // DMA work queue
+#define HAVE_DEVICE 0x10                    // Device file in the class
+#define HAVE_PCI    0x20                    // PCI device enabled
+
+// Consumer-side claim bits
+#define XPCIE_CLAIM_READER  0   // a reader owns the consumer side
+#define XPCIE_CLAIM_HOLD    1   // drop-oldest is moving rd_idx
 
 // Ioctl commands
 enum {
     XPCIE_IOCTL_INIT,
     XPCIE_IOCTL_FLUSH,
+    XPCIE_IOCTL_RELEASE,        // mmap reader: give back the events before ring index arg
+    XPCIE_IOCTL_READ_BATCH,     // read whole events; arg is xpcie_batch *
+    XPCIE_IOCTL_RING_SIZE,      // query / reallocate ring; arg is xpcie_ringsize *
+    XPCIE_IOCTL_FRAMED,         // arg 1: read() prefixes each event with an evtframe
+    XPCIE_IOCTL_OVERFLOW,       // set / query overflow policy; arg is xpcie_overflow *
+    XPCIE_IOCTL_BUSY_POLL,      // arg: spin this many us for an event before sleeping
+    XPCIE_IOCTL_USERBUF,        // DMA into user buffers; arg is xpcie_userbuf *
+    XPCIE_IOCTL_USERBUF_NEXT,   // wait for a filled user buffer; arg is xpcie_ubuf_evt *
+    XPCIE_IOCTL_SELFTEST,       // test-pattern DMA self-test; arg is xpcie_selftest *
+    XPCIE_IOCTL_LOCAL_CPUS,     // CPUs local to the board; arg is xpcie_cpus *
+    XPCIE_IOCTL_FREE_RUN,       // acquire without a reader; arg is xpcie_freerun *
     XPCIE_IOCTL_NUMCOMMANDS
 };
 
+// Batched read: events are copied back to back into buf, each one
+// preceded by an evthdr and padded to a multiple of EVTHDR_ALIGN bytes
+#define EVTHDR_ALIGN 8
+
+typedef struct {
+    u32 len;      // event length in bytes (excluding header and padding)
+    u32 seq;      // sequence number of the event (low 32 bits)
+} evthdr;
+
+// Framed read: each event is preceded by this header.  Sequence
+// numbers count transfers since the driver was loaded; a gap means
+// events were thrown away (flushed).  Times are CLOCK_MONOTONIC.
+typedef struct {
+    u32 len;      // event length in bytes (excluding header)
+    u32 pad;
+    u64 seq;      // sequence number of the event
+    u64 t_arm;    // when its DMA was started (ns)
+    u64 t_done;   // when the DMA completed (ns)
+} evtframe;
+
+typedef struct {
+    u64 buf;      // user buffer address
+    u32 size;     // user buffer size in bytes
+    u32 nevt;     // returned: number of events copied
+    u32 nbytes;   // returned: bytes of buf used
+    u32 pad;
+} xpcie_batch;
+
+// Ring geometry.  Set nevt and bufsize to zero to just query the
+// current values.
+typedef struct {
+    u32 nevt;        // number of slots (power of two)
+    u32 bufsize;     // bytes per slot (largest event when packed)
+    u32 arena_bytes; // pack events into an arena this big (0 = not packed)
+} xpcie_ringsize;
+
+// What to do with new events when the ring is full
+enum {
+    XPCIE_OVF_BLOCK,            // stall the endpoint until the reader frees a slot
+    XPCIE_OVF_DROP_OLDEST,      // overwrite the oldest unread event
+    XPCIE_OVF_DROP_NEWEST,      // throw the new event away
+    XPCIE_OVF_NUM
+};
+
+#define XPCIE_OVF_QUERY 0xffffffff
+
+typedef struct {
+    u32 policy;      // XPCIE_OVF_*, or XPCIE_OVF_QUERY to leave it as is; returns the policy
+    u32 pad;
+    u64 dropped;     // returned: events dropped since the driver was loaded
+} xpcie_overflow;
+
+// Free-running acquisition: DMA starts at load time and goes on while
+// no reader has the device open, under its own overflow policy.  A new
+// reader picks up at the oldest event still in the ring.
+#define XPCIE_FREERUN_QUERY 0xffffffff
+
+typedef struct {
+    u32 enable;      // 1 = on, 0 = off, XPCIE_FREERUN_QUERY to leave it as is; returns the setting
+    u32 overflow;    // XPCIE_OVF_* policy while there is no reader; returns the policy
+    u32 pending;     // returned: events waiting in the ring
+    u32 pad;
+} xpcie_freerun;
+
+// User buffer pool: nbuf buffers of bufsize bytes, back to back from
+// addr, become the ring slots.  Each buffer must be physically
+// contiguous, e.g. in hugepage-backed memory.  nbuf = 0 goes back to
+// the driver's own buffers.
+typedef struct {
+    u64 addr;        // page aligned
+    u32 nbuf;        // power of two
+    u32 bufsize;     // multiple of the page size
+} xpcie_userbuf;
+
+// A filled user buffer, returned by XPCIE_IOCTL_USERBUF_NEXT.  Hand it
+// back with XPCIE_IOCTL_RELEASE, arg index + 1, once done with it.
+typedef struct {
+    u32 index;       // ring index; the buffer is index % nbuf
+    u32 len;         // event length in bytes
+    u64 seq;         // sequence number of the event
+    u64 t_arm;       // DMA start and completion times (CLOCK_MONOTONIC ns)
+    u64 t_done;
+} xpcie_ubuf_evt;
+
+// DMA self-test with the XAPP1052 test-pattern registers.  Event
+// acquisition is paused while it runs.
+#define XPCIE_SELFTEST_READ 1   // also test read DMA (host to device)
+
+typedef struct {
+    u32 done;        // transfers with good data
+    u32 errors;      // transfers that timed out or had bad data
+    u64 bytes;       // bytes moved by the good transfers
+    u64 ns;          // their total time; bytes / ns is GB/s
+    u64 min_ns;      // fastest and slowest good transfer
+    u64 max_ns;
+} xpcie_selftest_res;
+
+typedef struct {
+    u32 ntransfers;  // transfers in each direction
+    u32 tlp_dwords;  // TLP payload size in dwords (0 = max payload size)
+    u32 tlp_count;   // TLPs per transfer
+    u32 pattern;     // test pattern
+    u32 flags;       // XPCIE_SELFTEST_*
+    u32 pad;
+    xpcie_selftest_res wr;   // returned: write DMA (device to host)
+    xpcie_selftest_res rd;   // returned: read DMA, if asked for
+} xpcie_selftest;
+
+// Where the board sits, for pinning the reader.  Bit n of mask is
+// CPU n, as in a cpu_set_t.
+#define XPCIE_CPUMASK_WORDS 16
+
+typedef struct {
+    s32 node;        // NUMA node of the board (-1 = unknown)
+    s32 irq_cpu;     // CPU the interrupt is steered to (-1 = node's CPUs)
+    s32 dma_cpu;     // CPU the DMA setup runs on (-1 = any)
+    u32 pad;
+    u64 mask[XPCIE_CPUMASK_WORDS];   // CPUs on the board's node
+} xpcie_cpus;
+
 // Debug printk can be disabled
 #undef PDEBUG
 #ifdef ATRI_DEBUG
@@ -0,0 +1,190 @@
+/*
+ * Software-emulated ATRI endpoint for the PCIe link driver.
+ *
+ * Stands in for the register file and bus-master DMA engine so the
+ * driver can be exercised and benchmarked without hardware.  Implements
+ * the REG_DCSR / REG_DDMACR / REG_WDMATLPA / REG_WDMATLPEX subset of the
+ * protocol used by the driver: a write start fills the buffer at the
+ * programmed DMA address with an event, sets DDMACR_WR_DONE and raises
+ * the completion "interrupt" by calling the handler from an hrtimer.
+ *
+ * John Kelley
+ * jkelley@icecube.wisc.edu
+ */
+
+#ifndef __ATRI_SIM__
+#define __ATRI_SIM__
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+
+#define SIM_NREGS 32
+
+// Module parameters
+static int gSimMode = 0;
+module_param_named(sim, gSimMode, int, S_IRUGO);
+MODULE_PARM_DESC(sim, "Use this many software-emulated endpoints instead of the PCIe boards");
+
+static unsigned int sim_evt_bytes = 16384;
+module_param(sim_evt_bytes, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_evt_bytes, "Simulated event size in bytes");
+
+static unsigned int sim_evt_bytes_max = 0;
+module_param(sim_evt_bytes_max, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_evt_bytes_max, "If larger than sim_evt_bytes, event sizes are uniform up to this");
+
+static unsigned int sim_rate_hz = 1000;
+module_param(sim_rate_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_rate_hz, "Simulated trigger rate (0 = as fast as possible)");
+
+static unsigned int sim_lost_irq = 0;
+module_param(sim_lost_irq, uint, S_IRUGO);
+MODULE_PARM_DESC(sim_lost_irq, "Drop one completion interrupt in every N (0 = never)");
+
+typedef irq_handler_t (*sim_handler_t)(int irq, void *dev_id, struct pt_regs *regs);
+
+typedef struct {
+    u32 regs[SIM_NREGS];
+    struct hrtimer timer;
+    ktime_t next_trig;        // earliest time of the next simulated trigger
+    sim_handler_t handler;    // driver interrupt handler
+    void *dev_id;             // passed to the handler
+    spinlock_t lock;
+    u32 nevt;                 // events generated
+    u32 nlost;                // interrupts dropped on purpose
+    unsigned int maxbytes;    // size of the driver's DMA buffers
+} simdev;
+
+/*
+ * Fill the DMA buffer with an event: a running event counter followed
+ * by an incrementing halfword pattern.
+ */
+static unsigned int sim_fill_event(simdev *sim, u32 dma_addr) {
+    u32 *dst = (u32 *) phys_to_virt(dma_addr);
+    unsigned int bytes = sim_evt_bytes;
+    unsigned int i;
+    u32 r;
+
+    if (sim_evt_bytes_max > sim_evt_bytes) {
+        get_random_bytes(&r, sizeof(r));
+        bytes += r % (sim_evt_bytes_max - sim_evt_bytes + 1);
+    }
+    // Firmware transfers whole halfwords
+    bytes = min(bytes, sim->maxbytes) & ~1;
+
+    if (bytes >= 4)
+        dst[0] = sim->nevt;
+    for (i = 1; i < bytes/4; i++)
+        dst[i] = ((2*i+1) << 16) | (2*i);
+    return bytes;
+}
+
+static enum hrtimer_restart sim_dma_done(struct hrtimer *t) {
+
+    simdev *sim = container_of(t, simdev, timer);
+    unsigned long flags;
+    unsigned int bytes;
+    int raise;
+
+    spin_lock_irqsave(&sim->lock, flags);
+    bytes = sim_fill_event(sim, sim->regs[REG_WDMATLPA]);
+    sim->regs[REG_WDMATLPEX] = bytes / 2;
+    sim->regs[REG_DDMACR] = (sim->regs[REG_DDMACR] & ~DDMACR_WR_START) | DDMACR_WR_DONE;
+    sim->nevt++;
+
+    raise = !(sim->regs[REG_DDMACR] & DDMACR_WR_INTDIS);
+    if (raise && sim_lost_irq && ((sim->nevt % sim_lost_irq) == 0)) {
+        sim->nlost++;
+        raise = 0;
+    }
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    if (raise)
+        sim->handler(0, sim->dev_id, NULL);
+
+    return HRTIMER_NORESTART;
+}
+
+// Start a write DMA; completes at the next simulated trigger time
+static void sim_wr_start(simdev *sim) {
+
+    ktime_t now = ktime_get();
+
+    if (ktime_to_ns(sim->next_trig) < ktime_to_ns(now))
+        sim->next_trig = now;
+    hrtimer_start(&sim->timer, sim->next_trig, HRTIMER_MODE_ABS);
+    if (sim_rate_hz)
+        sim->next_trig = ktime_add_ns(sim->next_trig, NSEC_PER_SEC / sim_rate_hz);
+}
+
+u32 xpcie_sim_read_reg(simdev *sim, u32 dw_offset) {
+    return (dw_offset < SIM_NREGS) ? sim->regs[dw_offset] : 0;
+}
+
+void xpcie_sim_write_reg(simdev *sim, u32 dw_offset, u32 val) {
+
+    unsigned long flags;
+
+    if (dw_offset >= SIM_NREGS)
+        return;
+
+    switch (dw_offset) {
+    case REG_DCSR:
+        // Initiator reset aborts any transfer and clears DONE
+        if (val & DCSR_RESET) {
+            hrtimer_try_to_cancel(&sim->timer);
+            spin_lock_irqsave(&sim->lock, flags);
+            sim->regs[REG_DDMACR] = 0;
+            spin_unlock_irqrestore(&sim->lock, flags);
+        }
+        sim->regs[REG_DCSR] = val;
+        break;
+    case REG_DDMACR:
+        // Like the firmware, starting a transfer leaves DONE alone;
+        // only an initiator reset clears it
+        spin_lock_irqsave(&sim->lock, flags);
+        sim->regs[REG_DDMACR] = (val & ~DDMACR_WR_DONE) |
+            (sim->regs[REG_DDMACR] & DDMACR_WR_DONE);
+        if (val & DDMACR_WR_START)
+            sim_wr_start(sim);
+        spin_unlock_irqrestore(&sim->lock, flags);
+        break;
+    default:
+        sim->regs[dw_offset] = val;
+        break;
+    }
+}
+
+/*
+ * xpcie_sim_init: set up an emulated endpoint; handler is called
+ * with dev_id as the completion interrupt.
+ */
+void xpcie_sim_init(simdev *sim, sim_handler_t handler, void *dev_id) {
+    memset(sim, 0, sizeof(*sim));
+    spin_lock_init(&sim->lock);
+    hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    sim->timer.function = sim_dma_done;
+    sim->handler = handler;
+    sim->dev_id = dev_id;
+    sim->next_trig = ktime_get();
+    sim->maxbytes = EVTBUFSIZE;
+}
+
+// Events are truncated to the driver's buffer size
+void xpcie_sim_set_maxbytes(simdev *sim, unsigned int maxbytes) {
+    sim->maxbytes = maxbytes;
+}
+
+// Wait for a completion in progress, e.g. one that raced with an
+// initiator reset, so it doesn't fill a buffer that is about to go
+void xpcie_sim_sync(simdev *sim) {
+    hrtimer_cancel(&sim->timer);
+}
+
+void xpcie_sim_remove(simdev *sim, const char *name) {
+    hrtimer_cancel(&sim->timer);
+    printk(KERN_INFO "%s: sim: %u events generated, %u interrupts dropped\n",
+           name, sim->nevt, sim->nlost);
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Statistics for the ATRI PCIe link driver
+ *
+ * Counters and histograms are kept per CPU, so the DMA and read paths
+ * only ever touch local memory without locks or atomics.  They are
+ * summed over CPUs when read out through debugfs.
+ *
+ * John Kelley
+ * jkelley@icecube.wisc.edu
+ */
+
+#ifndef __ATRI_STATS__
+#define __ATRI_STATS__
+
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+
+#define STATS_OCC_BINS  9       // ring occupancy in eighths of the ring
+#define STATS_LAT_BINS  24      // latency, log2 microseconds
+
+// irq_timer recovery branches
+enum {
+    STATS_TMO_REARM,            // no transfer armed: set one up
+    STATS_TMO_FORCED,           // transfer done but IRQ lost: call the handler
+    STATS_TMO_RESET,            // transfer stuck: reset and retry
+    STATS_TMO_NUM
+};
+
+// All counters are u64, so the CPUs can be summed word by word
+typedef struct {
+    u64 events;                     // transfers completed
+    u64 bytes;                      // bytes transferred
+    u64 flushes;                    // ring flushes
+    u64 dropped_oldest;             // unread events overwritten on overflow
+    u64 dropped_newest;             // new events thrown away on overflow
+    u64 almost_full;                // times the ring became almost full
+    u64 wr_blocked;                 // times DMA setup waited on a full ring
+    u64 wr_blocked_ns;              // total time it waited
+    u64 timeouts[STATS_TMO_NUM];    // irq_timer firings by branch
+    u64 wd_checks;                  // irq_timer found the transfer still waiting
+    u64 wd_saved_ns;                // lost interrupts caught before IRQ_TIMEOUT_MS, by how much
+    u64 poll_enter;                 // switches from interrupts to polling
+    u64 poll_exit;                  // switches back to interrupts
+    u64 poll_passes;                // polling timer firings
+    u64 poll_events;                // transfers retired by polling
+    u64 poll_stale;                 // late interrupts for polled transfers
+    u64 irq_stale;                  // interrupts for transfers the watchdog already retired
+    u64 busy_poll_hits;             // reader found an event while spinning
+    u64 busy_poll_misses;           // reader spun in vain and went to sleep
+    u64 occ[STATS_OCC_BINS];        // ring occupancy after each completion
+    u64 arm_irq[STATS_LAT_BINS];    // DMA arm to completion
+    u64 irq_read[STATS_LAT_BINS];   // completion to read-out
+} xpcie_stats;
+
+#define STATS_WORDS (sizeof(xpcie_stats) / sizeof(u64))
+
+#define stats_inc(s, field)    this_cpu_inc((s)->field)
+#define stats_add(s, field, n) this_cpu_add((s)->field, n)
+
+inline u64 stats_now(void) { return ktime_to_ns(ktime_get()); }
+
+// Bin 0 is under 1 us; bin i holds [2^(i-1), 2^i) us
+inline unsigned stats_lat_bin(u64 ns) {
+    u64 us = div_u64(ns, 1000);
+    return us ? min_t(unsigned, fls64(us), STATS_LAT_BINS - 1) : 0;
+}
+
+/*
+ * stats_dma_done: a transfer of bytes into eb completed, leaving used
+ * of nevt ring slots full.  Stamps the event for stats_read_done.
+ */
+inline void stats_dma_done(xpcie_stats __percpu *s, evtbuf *eb, size_t bytes,
+                           unsigned used, unsigned nevt) {
+    eb->t_done = stats_now();
+    stats_inc(s, events);
+    stats_add(s, bytes, bytes);
+    stats_inc(s, occ[min(used * (STATS_OCC_BINS - 1) / nevt, STATS_OCC_BINS - 1U)]);
+    stats_inc(s, arm_irq[stats_lat_bin(eb->t_done - eb->t_arm)]);
+}
+
+// The reader is done with eb
+inline void stats_read_done(xpcie_stats __percpu *s, evtbuf *eb) {
+    stats_inc(s, irq_read[stats_lat_bin(stats_now() - eb->t_done)]);
+}
+
+// Sum the counters over all CPUs
+void stats_sum(xpcie_stats __percpu *s, xpcie_stats *sum) {
+    u64 *src, *dst = (u64 *) sum;
+    int cpu;
+    unsigned i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        src = (u64 *) per_cpu_ptr(s, cpu);
+        for (i = 0; i < STATS_WORDS; i++)
+            dst[i] += src[i];
+    }
+}
+
+static void stats_show_hist(struct seq_file *m, const char *name, u64 *bin) {
+    unsigned i;
+
+    seq_printf(m, "%s:\n", name);
+    for (i = 0; i < STATS_LAT_BINS; i++) {
+        if (bin[i])
+            seq_printf(m, "  < %8lu us %12llu\n", 1UL << i, bin[i]);
+    }
+}
+
+/*
+ * stats_show: print the summed statistics.
+ */
+void stats_show(struct seq_file *m, xpcie_stats __percpu *s) {
+    xpcie_stats sum;
+    unsigned i;
+
+    stats_sum(s, &sum);
+    seq_printf(m, "events           %llu\n", sum.events);
+    seq_printf(m, "bytes            %llu\n", sum.bytes);
+    seq_printf(m, "flushes          %llu\n", sum.flushes);
+    seq_printf(m, "dropped_oldest   %llu\n", sum.dropped_oldest);
+    seq_printf(m, "dropped_newest   %llu\n", sum.dropped_newest);
+    seq_printf(m, "almost_full      %llu\n", sum.almost_full);
+    seq_printf(m, "wr_blocked       %llu\n", sum.wr_blocked);
+    seq_printf(m, "wr_blocked_us    %llu\n", div_u64(sum.wr_blocked_ns, 1000));
+    seq_printf(m, "irq_timeout      rearm %llu forced %llu reset %llu\n",
+               sum.timeouts[STATS_TMO_REARM], sum.timeouts[STATS_TMO_FORCED],
+               sum.timeouts[STATS_TMO_RESET]);
+    seq_printf(m, "watchdog         checks %llu saved_ms %llu\n", sum.wd_checks,
+               div_u64(sum.wd_saved_ns, NSEC_PER_MSEC));
+    seq_printf(m, "poll_mode        enter %llu exit %llu\n", sum.poll_enter, sum.poll_exit);
+    seq_printf(m, "poll_passes      %llu\n", sum.poll_passes);
+    seq_printf(m, "poll_events      %llu\n", sum.poll_events);
+    seq_printf(m, "poll_stale_irq   %llu\n", sum.poll_stale);
+    seq_printf(m, "stale_irq        %llu\n", sum.irq_stale);
+    seq_printf(m, "busy_poll        hits %llu misses %llu\n",
+               sum.busy_poll_hits, sum.busy_poll_misses);
+    seq_printf(m, "occupancy (eighths of ring):\n");
+    for (i = 0; i < STATS_OCC_BINS; i++)
+        seq_printf(m, "  %u/8 %12llu\n", i, sum.occ[i]);
+    stats_show_hist(m, "arm_to_irq", sum.arm_irq);
+    stats_show_hist(m, "irq_to_read", sum.irq_read);
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Tracepoints for the ATRI PCIe link driver
+ *
+ * One event per stage of an event's trip through the ring: DMA armed,
+ * DMA completed, read out, plus ring-full stalls and lost-interrupt
+ * recovery.  They cost a predicted branch when tracing is off.  Use
+ * with e.g.
+ *
+ *   perf record -e 'atri_pcie:*' ...
+ *   echo 1 > /sys/kernel/debug/tracing/events/atri_pcie/enable
+ *
+ * John Kelley
+ * jkelley@icecube.wisc.edu
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM atri_pcie
+
+#if !defined(__ATRI_TRACE__) || defined(TRACE_HEADER_MULTI_READ)
+#define __ATRI_TRACE__
+
+#include <linux/tracepoint.h>
+
+// DMA started into the slot at idx
+TRACE_EVENT(atri_dma_arm,
+    TP_PROTO(int minor, unsigned idx, u64 addr),
+    TP_ARGS(minor, idx, addr),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned, idx)
+        __field(u64, addr)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->idx = idx;
+        __entry->addr = addr;
+    ),
+    TP_printk("dev=%d wr_idx=%u addr=0x%llx",
+              __entry->minor, __entry->idx, __entry->addr)
+);
+
+// DMA into the slot at idx completed with len bytes
+TRACE_EVENT(atri_dma_done,
+    TP_PROTO(int minor, unsigned idx, unsigned len),
+    TP_ARGS(minor, idx, len),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned, idx)
+        __field(unsigned, len)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->idx = idx;
+        __entry->len = len;
+    ),
+    TP_printk("dev=%d wr_idx=%u len=%u",
+              __entry->minor, __entry->idx, __entry->len)
+);
+
+// The reader consumed n events starting at idx
+TRACE_EVENT(atri_read,
+    TP_PROTO(int minor, unsigned idx, unsigned n),
+    TP_ARGS(minor, idx, n),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned, idx)
+        __field(unsigned, n)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->idx = idx;
+        __entry->n = n;
+    ),
+    TP_printk("dev=%d rd_idx=%u n=%u",
+              __entry->minor, __entry->idx, __entry->n)
+);
+
+// DMA setup found no free slot and is waiting for the reader
+TRACE_EVENT(atri_ring_full,
+    TP_PROTO(int minor, unsigned wr_idx, unsigned rd_idx),
+    TP_ARGS(minor, wr_idx, rd_idx),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned, wr_idx)
+        __field(unsigned, rd_idx)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->wr_idx = wr_idx;
+        __entry->rd_idx = rd_idx;
+    ),
+    TP_printk("dev=%d wr_idx=%u rd_idx=%u",
+              __entry->minor, __entry->wr_idx, __entry->rd_idx)
+);
+
+// The lost-interrupt timer fired; branch is a STATS_TMO_* value
+TRACE_EVENT(atri_irq_timeout,
+    TP_PROTO(int minor, int branch),
+    TP_ARGS(minor, branch),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, branch)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->branch = branch;
+    ),
+    TP_printk("dev=%d recovery=%s", __entry->minor,
+              __print_symbolic(__entry->branch,
+                               { STATS_TMO_REARM, "rearm" },
+                               { STATS_TMO_FORCED, "forced" },
+                               { STATS_TMO_RESET, "reset" }))
+);
+
+// Completion switched to polling (on = 1) or back to interrupts at
+// the measured event rate
+TRACE_EVENT(atri_poll_mode,
+    TP_PROTO(int minor, int on, u64 rate),
+    TP_ARGS(minor, on, rate),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(int, on)
+        __field(u64, rate)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->on = on;
+        __entry->rate = rate;
+    ),
+    TP_printk("dev=%d mode=%s rate=%llu Hz", __entry->minor,
+              __entry->on ? "poll" : "irq", __entry->rate)
+);
+
+#endif
+
+// The header is not in include/trace/events; look for it here
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE atri-trace
+#include <trace/define_trace.h>
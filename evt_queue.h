@@ -9,84 +9,643 @@
 #ifndef __ATRI_EVT_QUEUE__
 #define __ATRI_EVT_QUEUE__
 
+// Default ring geometry; the actual number of slots and slot size
+// are set when the queue is allocated
 #define NEVTQ_BITS  5
 #define NEVT       (1 << NEVTQ_BITS)
-#define EVTQMASK   (NEVT-1)
-
-#define NEVT_ALMOST_FULL (NEVT-8)
+#define NEVT_MAX    1024
 
 #define EVTBUFSIZE  512000
 
+// Packed mode: events are placed back to back in an arena made of
+// chunks of up to ARENA_CHUNK bytes, each starting ARENA_ALIGN aligned
+#define ARENA_CHUNK BUF_SIZE
+#define ARENA_ALIGN 64
+
+// Where an evtbuf's memory came from
+#define EVTBUF_PAGES   0x1    // alloc_pages rather than coherent memory
+#define EVTBUF_MAPPED  0x2    // streaming mapping: sync around each transfer
+#define EVTBUF_USER    0x4    // pinned user memory
+
 typedef struct {
     unsigned char *buf;
     dma_addr_t physaddr;
+    unsigned flags;   // EVTBUF_*
     size_t len; 
+    size_t off;       // offset of buf from the start of the ring memory
+    u64 seq;          // event sequence number
+    u64 t_arm;        // when the transfer was started (ns)
+    u64 t_done;       // when it completed (ns)
+    atomic_t refs;    // pipe buffers still pointing into the event
 } evtbuf;
 
 typedef struct {
-    evtbuf evt[NEVT];
+    u32 len;          // event length in bytes
+    u32 off;          // event offset from the end of the control area
+    u64 seq;          // event sequence number; a gap means lost events
+    u64 t_arm;        // DMA start and completion times (CLOCK_MONOTONIC ns)
+    u64 t_done;
+} evtq_slotinfo;
+
+// Control area shared read-only with an mmap reader.
+// The driver mirrors the ring indices and event lengths here.
+typedef struct {
+    u32 wr_idx;
+    u32 rd_idx;
+    u32 nevt;
+    u32 slot_bytes;   // stride of DMA buffers (slots or arena chunks) in the mapping
+    u32 ctrl_bytes;   // size of this area; DMA buffers follow it
+    u32 packed;       // events are packed in an arena
+    u64 dropped;      // events lost to the overflow policy
+    evtq_slotinfo slot[0];
+} evtq_ctrl;
+
+/*
+ * Index publication between the one producer (DMA completion) and the
+ * one consumer (the reader).  smp_load_acquire / smp_store_release
+ * only appear in 3.14; spell them out with full barriers before that.
+ */
+#ifdef smp_load_acquire
+#define evtq_load_acquire(p)     smp_load_acquire(p)
+#define evtq_store_release(p, v) smp_store_release(p, v)
+#else
+#define evtq_load_acquire(p)     ({ typeof(*(p)) __v = ACCESS_ONCE(*(p)); smp_mb(); __v; })
+#define evtq_store_release(p, v) do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#endif
+
+/*
+ * Single-producer / single-consumer event ring.  The producer side
+ * (wr_idx and the DMA state) is only changed by the completion path,
+ * under lock; the lock guards arming and recovering the DMA engine,
+ * not the ring.  The consumer side (rd_idx) is only changed by the
+ * reader, without the lock.  Each publishes its index with release
+ * semantics and reads the other's with acquire semantics, and the two
+ * sides live on separate cache lines.
+ */
+typedef struct {
+    evtbuf *evt;
+    unsigned nevt;        // number of slots, a power of two
+    unsigned mask;
+    size_t bufsize;       // bytes per slot (largest event when packed)
+    unsigned almost_full; // entries at which the ring counts as almost full
+    evtbuf *blk;          // DMA memory: one block per slot, or arena chunks
+    unsigned nblk;
+    size_t blksize;
+    int packed;
+    size_t arena_size;    // packed: total bytes in the arena
+    size_t arena_wr;      // packed: where the next event goes
+    evtq_ctrl *ctrl;
+    unsigned ctrl_order;  // page order of the control area
+    unsigned blk_pages;   // pages per DMA block in the mmap view
+    unsigned mmap_pages;  // pages in the whole mmap view
     struct pci_dev *dev;
-    unsigned rd_idx;
-    unsigned wr_idx;
+    int node;             // NUMA node of the device; ring memory comes from there
+    int streaming;        // DMA into cached pages with streaming mappings
+    struct page **upages; // slots are pinned user buffers: their pages
+    unsigned long nupages;
     wait_queue_head_t rd_waitq;
     wait_queue_head_t wr_waitq;
-    spinlock_t lock;
+
+    // Producer side
+    spinlock_t lock ____cacheline_aligned_in_smp;
+    unsigned wr_idx;
+    u64 seq;          // sequence number of the next event; kept across resizes
+    u64 dropped;      // events dropped on overflow
+    evtbuf scratch;   // drop-newest: transfers into a full ring land here
+    int dma_scratch;  // the transfer in progress is to scratch; protect by lock
     int dma_started; // protect by lock
+    unsigned dma_idx; // next slot to post for DMA; protect by lock
+
+    // Consumer side
+    unsigned rd_idx ____cacheline_aligned_in_smp;
 } evtq;
 
-inline evtbuf *evtq_getevent(evtq *q, unsigned i) { return &(q->evt[i&EVTQMASK]); }
-inline unsigned evtq_entries(evtq *q) { return q->wr_idx - q->rd_idx; }
-inline int evtq_isfull(evtq *q)  { return NEVT == evtq_entries(q); }
-inline int evtq_isalmostfull(evtq *q)  { return NEVT_ALMOST_FULL == evtq_entries(q); }
-inline int evtq_isempty(evtq *q) { return q->wr_idx == q->rd_idx; }
-inline void empty_evtq(evtq *q) { q->wr_idx = q->rd_idx = 0; }
+inline evtbuf *evtq_getevent(evtq *q, unsigned i) { return &(q->evt[i & q->mask]); }
+
+// Either side, or a bystander (poll): a snapshot of the fill level
+inline unsigned evtq_entries(evtq *q) { 
+    return ACCESS_ONCE(q->wr_idx) - ACCESS_ONCE(q->rd_idx); 
+}
+inline int evtq_isfull(evtq *q)  { return q->nevt == evtq_entries(q); }
+inline int evtq_isalmostfull(evtq *q)  { return q->almost_full <= evtq_entries(q); }
+
+// Consumer: events ready to read.  Their contents are visible once
+// this returns.
+inline unsigned evtq_avail(evtq *q) { return evtq_load_acquire(&q->wr_idx) - q->rd_idx; }
+inline int evtq_isempty(evtq *q) { return evtq_avail(q) == 0; }
+
+// Producer: slots the reader has not given back yet
+inline unsigned evtq_used(evtq *q) { return q->wr_idx - evtq_load_acquire(&q->rd_idx); }
+inline unsigned evtq_posted(evtq *q) { return q->dma_idx - q->wr_idx; }
+inline int evtq_canpost(evtq *q, unsigned depth) {
+    return (q->dma_idx - evtq_load_acquire(&q->rd_idx) < q->nevt) && (evtq_posted(q) < depth);
+}
+
+/*
+ * evtq_arena_pos: in a packed queue, where the next event (the slot at
+ * wr_idx) goes: right after the previous one, or at the start of the
+ * next chunk if a full-size event would not fit in this one.  Returns
+ * ARENA_NOROOM if there is no room until the reader frees some.
+ */
+#define ARENA_NOROOM ((size_t)-1)
+
+inline size_t evtq_arena_pos(evtq *q) {
+    size_t pos = q->arena_wr;
+    size_t tail, avail, skip;
+    unsigned rd = evtq_load_acquire(&q->rd_idx);
+
+    // Events don't straddle chunks
+    if ((pos % q->blksize) + q->bufsize > q->blksize)
+        pos = (pos - pos % q->blksize + q->blksize) % q->arena_size;
+
+    // Free space runs from arena_wr up to the oldest unread event
+    if (q->wr_idx != rd) {
+        tail = evtq_getevent(q, rd)->off;
+        avail = (tail + q->arena_size - q->arena_wr) % q->arena_size;
+        skip = (pos + q->arena_size - q->arena_wr) % q->arena_size;
+        if (skip + q->bufsize > avail)
+            return ARENA_NOROOM;
+    }
+    return pos;
+}
+
+/*
+ * evtq_place: pick the buffer for the next transfer (the slot at
+ * wr_idx).  Slots have their own buffers unless the queue is packed.
+ * Returns 0 if there is no room for the event yet.
+ */
+inline int evtq_place(evtq *q) {
+    evtbuf *eb = evtq_getevent(q, q->wr_idx);
+    evtbuf *chunk;
+    size_t pos;
+
+    if (!q->packed)
+        return 1;
+
+    pos = evtq_arena_pos(q);
+    if (pos == ARENA_NOROOM)
+        return 0;
+
+    chunk = &q->blk[pos / q->blksize];
+    eb->flags = chunk->flags;
+    eb->off = pos;
+    eb->buf = chunk->buf + pos % q->blksize;
+    eb->physaddr = chunk->physaddr + pos % q->blksize;
+    return 1;
+}
+
+// Could a transfer be started (a slot is posted or free, and it fits)?
+inline int evtq_canarm(evtq *q) {
+    if (!evtq_posted(q) && (q->dma_idx - evtq_load_acquire(&q->rd_idx) >= q->nevt))
+        return 0;
+    return !q->packed || (evtq_arena_pos(q) != ARENA_NOROOM);
+}
+
+// Consumer: discard all unread events.  Slots posted for DMA are
+// kept, since the device may already be writing to them.
+inline void empty_evtq(evtq *q) { 
+    unsigned wr = evtq_load_acquire(&q->wr_idx);
+    evtq_store_release(&q->rd_idx, wr);
+    evtq_store_release(&q->ctrl->rd_idx, wr);
+}
+
+/*
+ * evtq_commit: an event of len bytes has landed in the slot at wr_idx.
+ * Publish it to readers (including the mmap control page).  Producer
+ * only.
+ */
+inline void evtq_commit(evtq *q, size_t len) {
+    evtbuf *eb = evtq_getevent(q, q->wr_idx);
+    evtq_slotinfo *si = &q->ctrl->slot[q->wr_idx & q->mask];
+
+    len = min(len, q->bufsize);
+    eb->len = len;
+    eb->seq = q->seq++;
+    if (q->packed)
+        q->arena_wr = (eb->off + ALIGN(len, ARENA_ALIGN)) % q->arena_size;
+
+    si->len = len;
+    si->off = eb->off;
+    si->seq = eb->seq;
+    si->t_arm = eb->t_arm;
+    si->t_done = eb->t_done;
+
+    // mmap readers go by the control area's copy, so it needs the
+    // same ordering against the slot info as wr_idx itself
+    evtq_store_release(&q->wr_idx, q->wr_idx + 1);
+    evtq_store_release(&q->ctrl->wr_idx, q->wr_idx);
+}
+
+/*
+ * evtq_release: the reader is done with n events.  Hand the slots back
+ * and wake up any sleeping DMA setup.  Consumer only.
+ */
+inline void evtq_release(evtq *q, unsigned n) {
+    evtq_store_release(&q->rd_idx, q->rd_idx + n);
+    evtq_store_release(&q->ctrl->rd_idx, q->rd_idx);
+
+    // Order the index store against the waiter check; only take the
+    // waitqueue lock if DMA setup is actually sleeping.
+    smp_mb();
+    if (waitqueue_active(&q->wr_waitq))
+        wake_up_interruptible(&q->wr_waitq);
+}
+
+/*
+ * evtq_drop_oldest: throw away the oldest unread event.  Call as the
+ * producer, with the consumer side held off.
+ */
+inline void evtq_drop_oldest(evtq *q) {
+    q->dropped++;
+    q->ctrl->dropped = q->dropped;
+    evtq_release(q, 1);
+}
+
+/*
+ * evtq_drop_newest: the transfer went to the scratch buffer.  It still
+ * uses up a sequence number, so the reader sees the gap.  Producer
+ * only.
+ */
+inline void evtq_drop_newest(evtq *q) {
+    q->seq++;
+    q->dropped++;
+    q->ctrl->dropped = q->dropped;
+}
     
+/*
+ * DMA buffers are either coherent memory, or, when streaming, ordinary
+ * cached pages with a streaming mapping that is synced around each
+ * transfer.  Coherent memory is uncached on some platforms, which makes
+ * copying events out slow.  Pinned user buffers are mapped the same
+ * way.  A simulated queue (no PCI device) uses the physical address of
+ * the pages and needs no syncing.  Either way the buffer has to lie
+ * below the device's DMA mask (32 bits without a device), or its
+ * address would be truncated when programmed into the endpoint.
+ */
+inline struct device *evtq_dmadev(evtq *q) { return q->dev ? &q->dev->dev : NULL; }
+
+inline int evtq_dma_reachable(evtq *q, dma_addr_t addr, size_t size) {
+    return (u64) addr + size - 1 <= dma_get_mask(evtq_dmadev(q));
+}
+
+// The buffers are refcounted pages that others (a pipe) may hold on
+// to: streaming buffers, allocated compound, and pinned user pages
+inline int evtq_has_pages(evtq *q) { return q->streaming || (q->upages != NULL); }
+
+// Streaming-map size bytes starting at pg for the device to write
+int evtq_map_page(evtq *q, evtbuf *eb, struct page *pg, size_t size) {
+    if (q->dev == NULL) {
+        eb->physaddr = page_to_phys(pg);
+        return evtq_dma_reachable(q, eb->physaddr, size) ? 0 : -EINVAL;
+    }
+    eb->physaddr = dma_map_page(evtq_dmadev(q), pg, 0, size, DMA_FROM_DEVICE);
+    if (dma_mapping_error(evtq_dmadev(q), eb->physaddr))
+        return -ENOMEM;
+    if (!evtq_dma_reachable(q, eb->physaddr, size)) {
+        dma_unmap_page(evtq_dmadev(q), eb->physaddr, size, DMA_FROM_DEVICE);
+        return -EINVAL;
+    }
+    eb->flags |= EVTBUF_MAPPED;
+    return 0;
+}
+
+int evtq_alloc_buf(evtq *q, evtbuf *eb, size_t size) {
+    struct page *pg;
+
+    eb->flags = 0;
+    if (!q->streaming) {
+        eb->buf = pci_alloc_consistent(q->dev, size, &eb->physaddr);
+        if (eb->buf == NULL)
+            return -ENOMEM;
+        if (!evtq_dma_reachable(q, eb->physaddr, size)) {
+            pci_free_consistent(q->dev, size, eb->buf, eb->physaddr);
+            eb->buf = NULL;
+            return -ENOMEM;
+        }
+        return 0;
+    }
+
+    // Low memory, so the device can reach it without bounce buffers
+    eb->buf = NULL;
+    pg = alloc_pages_node(q->node, GFP_KERNEL | GFP_DMA32 | __GFP_COMP, get_order(size));
+    if (pg == NULL)
+        return -ENOMEM;
+    eb->flags = EVTBUF_PAGES;
+    if (evtq_map_page(q, eb, pg, size)) {
+        __free_pages(pg, get_order(size));
+        return -ENOMEM;
+    }
+    eb->buf = page_address(pg);
+    return 0;
+}
+
+void evtq_free_buf(evtq *q, evtbuf *eb, size_t size) {
+    if (eb->buf == NULL)
+        return;
+
+    if (eb->flags & EVTBUF_MAPPED)
+        dma_unmap_page(evtq_dmadev(q), eb->physaddr, size, DMA_FROM_DEVICE);
+    if (eb->flags & EVTBUF_PAGES)
+        free_pages((unsigned long) eb->buf, get_order(size));
+    else if (!(eb->flags & EVTBUF_USER))
+        pci_free_consistent(q->dev, size, eb->buf, eb->physaddr);
+    eb->buf = NULL;
+}
+
+// Streaming: hand len bytes of eb to the device before a transfer
+inline void evtq_sync_for_device(evtq *q, evtbuf *eb, size_t len) {
+    if (eb->flags & EVTBUF_MAPPED)
+        dma_sync_single_for_device(evtq_dmadev(q), eb->physaddr, len, DMA_FROM_DEVICE);
+}
+
+// Streaming: take len bytes of eb back for the CPU after a transfer
+inline void evtq_sync_for_cpu(evtq *q, evtbuf *eb, size_t len) {
+    if (eb->flags & EVTBUF_MAPPED)
+        dma_sync_single_for_cpu(evtq_dmadev(q), eb->physaddr, len, DMA_FROM_DEVICE);
+}
+
+/*
+ * evtq_free_bufs: free an array of n DMA buffers of size bytes.
+ */
+void evtq_free_bufs(evtq *q, evtbuf *blk, unsigned n, size_t size) {
+    unsigned i;
+    if (blk == NULL)
+        return;
+
+    for (i = 0; i < n; i++)
+        evtq_free_buf(q, &blk[i], size);
+    kfree(blk);
+}
+
+/*
+ * evtq_alloc_scratch: allocate the buffer for drop-newest transfers,
+ * if there isn't one of the slot size yet.  The caller must make sure
+ * no transfer to the old one is in progress.
+ */
+int evtq_alloc_scratch(evtq *q) {
+    evtbuf *sb = &q->scratch;
+
+    if ((sb->buf != NULL) && (sb->len >= q->bufsize))
+        return 0;
+    evtq_free_buf(q, sb, sb->len);
+
+    if (evtq_alloc_buf(q, sb, q->bufsize)) {
+        sb->len = 0;
+        return -ENOMEM;
+    }
+    sb->len = q->bufsize;
+    return 0;
+}
+
+// Let go of pinned user pages; the device may have written them
+void evtq_unpin(struct page **pages, unsigned long n) {
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        set_page_dirty_lock(pages[i]);
+        put_page(pages[i]);
+    }
+    vfree(pages);
+}
+
+/*
+ * evtq_free: free the slots, DMA memory and control area of the queue.
+ */
+void evtq_free(evtq *q) {
+    if (q->packed)
+        kfree(q->evt);
+    evtq_free_bufs(q, q->blk, q->nblk, q->blksize);
+    if (q->ctrl != NULL)
+        free_pages((unsigned long)q->ctrl, q->ctrl_order);
+    if (q->upages != NULL) {
+        evtq_unpin(q->upages, q->nupages);
+        q->upages = NULL;
+    }
+}
+
+/*
+ * evtq_install: make the given slots, DMA buffers and control area the
+ * queue's ring, empty.  The old ones must have been freed.
+ */
+void evtq_install(evtq *q, evtbuf *evt, unsigned nevt, size_t bufsize,
+                  evtbuf *blk, unsigned nblk, size_t blksize, int packed,
+                  evtq_ctrl *ctrl, unsigned order) {
+    q->evt = evt;
+    q->nevt = nevt;
+    q->mask = nevt - 1;
+    q->bufsize = bufsize;
+    q->almost_full = nevt - nevt/4;
+    q->blk = blk;
+    q->nblk = nblk;
+    q->blksize = blksize;
+    q->packed = packed;
+    q->arena_size = nblk * blksize;
+    q->arena_wr = 0;
+    q->ctrl = ctrl;
+    q->ctrl_order = order;
+    q->blk_pages = PAGE_ALIGN(blksize) >> PAGE_SHIFT;
+    q->mmap_pages = (1 << order) + nblk*q->blk_pages;
+
+    ctrl->nevt = nevt;
+    ctrl->slot_bytes = q->blk_pages << PAGE_SHIFT;
+    ctrl->ctrl_bytes = PAGE_SIZE << order;
+    ctrl->packed = q->packed;
+
+    q->wr_idx = q->rd_idx = q->dma_idx = 0;
+    ctrl->dropped = q->dropped;
+}
+
+/*
+ * evtq_alloc: allocate nevt slots for events of up to bufsize bytes,
+ * plus the control area, and install them in the queue in place of the
+ * old ones.  If arena_bytes is zero each slot gets its own DMA buffer;
+ * otherwise events are packed in an arena of that many bytes.  On
+ * failure the queue is left as it was.  The ring is emptied, so the
+ * caller must make sure no DMA is in progress.
+ */
+int evtq_alloc(evtq *q, unsigned nevt, size_t bufsize, size_t arena_bytes) {
+    unsigned i;
+    unsigned order;
+    int failed = 0;
+    evtbuf *evt, *blk;
+    unsigned nblk;
+    size_t blksize;
+    evtq_ctrl *ctrl;
+    struct page *pg;
+
+    evt = (evtbuf *) kzalloc_node(nevt * sizeof(evtbuf), GFP_KERNEL, q->node);
+    if (evt == NULL)
+        return -ENOMEM;
+
+    // Allocate the DMA buffers: one per event, or the arena chunks
+    if (arena_bytes) {
+        blksize = min((size_t)ARENA_CHUNK, (size_t)PAGE_ALIGN(arena_bytes));
+        nblk = DIV_ROUND_UP(arena_bytes, blksize);
+        blk = (evtbuf *) kzalloc_node(nblk * sizeof(evtbuf), GFP_KERNEL, q->node);
+        if (blk == NULL) {
+            kfree(evt);
+            return -ENOMEM;
+        }
+    }
+    else {
+        blksize = bufsize;
+        nblk = nevt;
+        blk = evt;
+    }
+
+    for (i = 0; i < nblk; i++) {
+        failed |= evtq_alloc_buf(q, &blk[i], blksize);
+        blk[i].off = i * PAGE_ALIGN(blksize);
+    }
+
+    // Control area for mmap readers
+    order = get_order(sizeof(evtq_ctrl) + nevt*sizeof(evtq_slotinfo));
+    pg = alloc_pages_node(q->node, GFP_KERNEL | __GFP_ZERO, order);
+    ctrl = (pg != NULL) ? (evtq_ctrl *) page_address(pg) : NULL;
+    failed |= (ctrl == NULL);
+
+    if (failed) {
+        printk(KERN_WARNING "evtq_alloc: allocations failed!\n");
+        evtq_free_bufs(q, blk, nblk, blksize);
+        if (arena_bytes)
+            kfree(evt);
+        if (ctrl != NULL)
+            free_pages((unsigned long)ctrl, order);
+        return -ENOMEM;
+    }
+
+    // Swap in the new ring
+    evtq_free(q);
+    evtq_install(q, evt, nevt, bufsize, blk, nblk, blksize, arena_bytes != 0, ctrl, order);
+
+    // Keep the scratch buffer, if there is one, big enough
+    if (q->scratch.buf != NULL)
+        evtq_alloc_scratch(q);
+    return 0;
+}
+
+/*
+ * evtq_alloc_user: like evtq_alloc, but the nevt slots are buffers of
+ * bufsize bytes supplied by the caller, back to back from uaddr.  The
+ * pages are pinned until the ring is freed or replaced.  The device
+ * writes each buffer at a single address, so each one must be
+ * physically contiguous (e.g. inside a hugepage) and in low memory,
+ * and its single streaming mapping must be below the DMA mask; if
+ * not, -EINVAL.  Both uaddr and bufsize must be page aligned.
+ */
+int evtq_alloc_user(evtq *q, unsigned long uaddr, unsigned nevt, size_t bufsize) {
+    unsigned long ppb = bufsize >> PAGE_SHIFT;
+    unsigned long npages = nevt * ppb;
+    unsigned long j;
+    struct page **pages;
+    struct page *pg;
+    evtbuf *evt;
+    evtq_ctrl *ctrl;
+    unsigned order, i = 0;
+    int got = 0;
+    int ret = -ENOMEM;
+
+    if ((uaddr & ~PAGE_MASK) || (bufsize & ~PAGE_MASK) || (bufsize == 0))
+        return -EINVAL;
+
+    pages = (struct page **) vmalloc(npages * sizeof(*pages));
+    evt = (evtbuf *) kzalloc_node(nevt * sizeof(evtbuf), GFP_KERNEL, q->node);
+    order = get_order(sizeof(evtq_ctrl) + nevt*sizeof(evtq_slotinfo));
+    pg = alloc_pages_node(q->node, GFP_KERNEL | __GFP_ZERO, order);
+    ctrl = (pg != NULL) ? (evtq_ctrl *) page_address(pg) : NULL;
+    if ((pages == NULL) || (evt == NULL) || (ctrl == NULL))
+        goto fail;
+
+    got = get_user_pages_fast(uaddr, npages, 1, pages);
+    if (got < (int) npages) {
+        ret = -EFAULT;
+        goto fail;
+    }
+
+    for (i = 0; i < nevt; i++) {
+        for (j = 1; j < ppb; j++) {
+            if (page_to_pfn(pages[i*ppb + j]) != page_to_pfn(pages[i*ppb]) + j)
+                break;
+        }
+        if ((j < ppb) || PageHighMem(pages[i*ppb])) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        // The whole buffer goes through one mapping, so its bus
+        // addresses are contiguous too; it just has to be reachable
+        evt[i].flags = EVTBUF_USER;
+        ret = evtq_map_page(q, &evt[i], pages[i*ppb], bufsize);
+        if (ret)
+            goto fail;
+        evt[i].buf = page_address(pages[i*ppb]);
+        evt[i].off = i * bufsize;
+    }
+
+    // Swap in the new ring
+    evtq_free(q);
+    evtq_install(q, evt, nevt, bufsize, evt, nevt, bufsize, 0, ctrl, order);
+    q->upages = pages;
+    q->nupages = npages;
+
+    // The buffers are in the caller's own memory; only the control
+    // area is for mapping
+    q->mmap_pages = 1 << order;
+
+    if (q->scratch.buf != NULL)
+        evtq_alloc_scratch(q);
+    return 0;
+
+ fail:
+    while (i-- > 0)
+        evtq_free_buf(q, &evt[i], bufsize);
+    kfree(evt);
+    if (pages != NULL)
+        evtq_unpin(pages, max(got, 0));
+    if (ctrl != NULL)
+        free_pages((unsigned long)ctrl, order);
+    return ret;
+}
+
 /* 
  * delete_evtq: clean up all memory allocated for the event queue. 
  */
 void delete_evtq(evtq *q) {
-    int i;    
     if (q == NULL)
         return;
-    
-    for (i = 0; i < NEVT; i++) {
-        evtbuf *eb = evtq_getevent(q, i);
-        if (eb->buf != NULL)
-            pci_free_consistent(q->dev, EVTBUFSIZE, eb->buf, eb->physaddr);
-    }
+
+    evtq_free(q);
+    evtq_free_buf(q, &q->scratch, q->scratch.len);
     kfree(q);
     q = NULL;
 }
 
 /*
- * Initialize the event queue.  Allocate memory for the event and map the 
- * DMA addresses.
+ * Initialize the event queue with nevt slots (a power of two) of 
+ * bufsize bytes, packed in an arena of arena_bytes if that is nonzero.
+ * Allocate memory for the event and map the DMA addresses, with
+ * streaming mappings if streaming is set.
  */
-evtq *new_evtq(struct pci_dev *dev) {
-    int i;
-    int failed = 0;
+evtq *new_evtq(struct pci_dev *dev, unsigned nevt, size_t bufsize, size_t arena_bytes,
+               int streaming) {
     evtq *q;
-    
-    // Allocate the queue itself
-    q = (evtq *) kmalloc(sizeof(evtq), GFP_KERNEL);
+    int node;
+
+    // Allocate the queue itself, next to the device.  Coherent DMA
+    // buffers already come from the device's node.
+    node = dev ? dev_to_node(&dev->dev) : NUMA_NO_NODE;
+    q = (evtq *) kzalloc_node(sizeof(evtq), GFP_KERNEL, node);
     if (q == NULL)
         return NULL;
 
-    // Allocate all of the events (DMA buffers)
-    for (i = 0; i < NEVT; i++) {
-        evtbuf *eb = evtq_getevent(q, i);
-        eb->buf = pci_alloc_consistent(dev, EVTBUFSIZE, &eb->physaddr);
-        failed |= (eb->buf == NULL);
-        eb->len = 0;
-    }
-    if (failed) {
-        printk(KERN_WARNING "new_evtq: allocations failed!\n");             
+    q->dev = dev;
+    q->node = node;
+    q->streaming = streaming;
+    if (evtq_alloc(q, nevt, bufsize, arena_bytes)) {
+        printk(KERN_WARNING "new_evtq: allocations failed!\n");
         delete_evtq(q);
         return NULL;
     }
-    
-    q->dev = dev;           
-    empty_evtq(q);
+
     init_waitqueue_head(&q->wr_waitq);
     init_waitqueue_head(&q->rd_waitq);
     spin_lock_init(&q->lock);
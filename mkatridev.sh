@@ -1,11 +1,16 @@
 #!/bin/sh
-# Make the device file for the ATRI PCIe driver.
-# Would be nice to move this to udev
+# Make the device files for the ATRI PCIe driver, one per board.
+# Would be nice to move this to udev (see atri-pcie.rules)
 #
 # J. Kelley <jkelley@icecube.wisc.edu>
 #
-rm -rf /dev/atri-pcie
-mknod /dev/atri-pcie c 241 1
-chown root /dev/atri-pcie
-chmod 0666 /dev/atri-pcie
-
+rm -rf /dev/atri-pcie /dev/atri-pcie[0-9]*
+for sysdev in /sys/class/atri-pcie/atri-pcie*/dev; do
+    [ -f $sysdev ] || continue
+    name=`basename \`dirname $sysdev\``
+    mknod /dev/$name c `cut -d: -f1 $sysdev` `cut -d: -f2 $sysdev`
+    chown root /dev/$name
+    chmod 0666 /dev/$name
+done
+# First board keeps the old name
+[ -e /dev/atri-pcie0 ] && ln -s atri-pcie0 /dev/atri-pcie
@@ -0,0 +1,369 @@
+/*
+ * Read benchmark and acquisition test for the ATRI PCIe driver.
+ *
+ * Reads events in framed mode for a number of events or seconds and
+ * reports throughput, completion-to-read latency percentiles, lost
+ * events and reader CPU time, one JSON object per run on stdout so
+ * results can be tracked from release to release.  Progress and errors
+ * go to stderr.
+ *
+ * John Kelley
+ * jkelley@icecube.wisc.edu
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define DEVNAME "/dev/atri-pcie"
+#define DEBUGFS "/sys/kernel/debug/atri-pcie"
+#define MAXEVTSIZE (4096 * 1024)
+#define MAXSWEEP 32
+#define MAXLAT 1000000          // latency samples kept per run
+
+// Ioctl commands, as in atri-pcie.h
+enum {
+    XPCIE_IOCTL_INIT,
+    XPCIE_IOCTL_FLUSH,
+    XPCIE_IOCTL_RELEASE,
+    XPCIE_IOCTL_READ_BATCH,
+    XPCIE_IOCTL_RING_SIZE,
+    XPCIE_IOCTL_FRAMED,
+    XPCIE_IOCTL_OVERFLOW,
+    XPCIE_IOCTL_BUSY_POLL
+};
+
+typedef struct {
+    uint32_t len;
+    uint32_t pad;
+    uint64_t seq;
+    uint64_t t_arm;
+    uint64_t t_done;
+} evtframe;
+
+typedef struct {
+    uint32_t policy;
+    uint32_t pad;
+    uint64_t dropped;
+} xpcie_overflow;
+
+#define XPCIE_OVF_QUERY 0xffffffff
+
+// Options
+static const char *devname = DEVNAME;
+static long maxevts = 0;            // 0 = no limit
+static double duration = 10.0;      // seconds, 0 = no limit
+static int nonblock = 0;
+static int cpu = -1;
+static unsigned busy_us = 0;
+static int nchunk = 1;
+static size_t chunks[MAXSWEEP] = { MAXEVTSIZE };
+
+static volatile sig_atomic_t stop = 0;    // end this run
+static volatile sig_atomic_t quit = 0;    // end the sweep
+
+static void on_alarm(int sig) { stop = 1; }
+static void on_int(int sig) { stop = quit = 1; }
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_s(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Value at quantile q of n sorted samples, in microseconds
+static double pct_us(uint64_t *v, long n, double q) {
+    long i;
+    if (n == 0)
+        return 0;
+    i = (long) (q * (n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+// A counter from the driver's debugfs statistics, or -1 if it
+// can't be read (not root, or no debugfs)
+static long long drv_stat(const char *name) {
+    char path[PATH_MAX], real[PATH_MAX], line[256];
+    size_t len = strlen(name);
+    long long val = -1;
+    FILE *fp;
+
+    if (realpath(devname, real) == NULL)
+        return -1;
+    snprintf(path, sizeof(path), "%s/%s/stats", DEBUGFS, basename(real));
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if ((strncmp(line, name, len) == 0) && (line[len] == ' ')) {
+            val = strtoll(line + len, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return val;
+}
+
+static uint64_t drv_dropped(int f) {
+    xpcie_overflow ovf = { XPCIE_OVF_QUERY, 0, 0 };
+    if (ioctl(f, XPCIE_IOCTL_OVERFLOW, &ovf) < 0)
+        return 0;
+    return ovf.dropped;
+}
+
+// Wait for the device to become readable in non-blocking mode
+static int wait_readable(int f) {
+    struct pollfd pfd = { f, POLLIN, 0 };
+    int ret = poll(&pfd, 1, 100);
+    if ((ret > 0) && (pfd.revents & POLLHUP))
+        return -1;
+    return ret;
+}
+
+//
+// One run at a given read size.  Reads whole events through framed
+// read(), in chunks of up to chunk bytes.
+//
+static int run(int f, unsigned char *buf, size_t chunk, uint64_t *lat) {
+
+    evtframe fr;
+    size_t pos = 0, total = 0;
+    long nevt = 0, nlat = 0;
+    uint64_t bytes = 0, gaps = 0, prev_seq = 0;
+    uint64_t t0, t1, dropped0, dropped;
+    long long full0, full1, afull0, afull1;
+    double c0, c1, secs, gb;
+    int have_seq = 0;
+    ssize_t n;
+
+    // Start from an empty ring
+    ioctl(f, XPCIE_IOCTL_FLUSH);
+    dropped0 = drv_dropped(f);
+    full0 = drv_stat("wr_blocked");
+    afull0 = drv_stat("almost_full");
+
+    stop = 0;
+    if (duration > 0) {
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        it.it_value.tv_sec = (long) duration;
+        it.it_value.tv_usec = (long) ((duration - (long) duration) * 1e6);
+        setitimer(ITIMER_REAL, &it, NULL);
+    }
+
+    c0 = cpu_s();
+    t0 = mono_ns();
+    while (!stop && ((maxevts == 0) || (nevt < maxevts))) {
+        n = read(f, buf, chunk);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) && nonblock) {
+                if (wait_readable(f) < 0)
+                    break;
+                continue;
+            }
+            fprintf(stderr, "readbench: read: %s\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        // Each event starts with its frame
+        if (pos == 0) {
+            if ((size_t) n < sizeof(fr)) {
+                fprintf(stderr, "readbench: short frame (%zd bytes)\n", n);
+                return -1;
+            }
+            memcpy(&fr, buf, sizeof(fr));
+            // Catch a driver that ignored the FRAMED ioctl: raw event
+            // data won't look like a frame for long
+            if ((fr.pad != 0) || (fr.len > MAXEVTSIZE) || (fr.t_done < fr.t_arm)) {
+                fprintf(stderr, "readbench: bad frame header (len %u); "
+                        "driver not in framed mode?\n", fr.len);
+                return -1;
+            }
+            total = sizeof(fr) + fr.len;
+            if (have_seq && (fr.seq != prev_seq + 1))
+                gaps += fr.seq - prev_seq - 1;
+            prev_seq = fr.seq;
+            have_seq = 1;
+            bytes -= sizeof(fr);
+        }
+        pos += n;
+        bytes += n;
+
+        // The driver never returns bytes of two events at once
+        if (pos == total) {
+            if (nlat < MAXLAT)
+                lat[nlat++] = mono_ns() - fr.t_done;
+            nevt++;
+            pos = 0;
+        }
+    }
+    t1 = mono_ns();
+    c1 = cpu_s();
+
+    if (duration > 0) {
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        setitimer(ITIMER_REAL, &it, NULL);
+    }
+
+    dropped = drv_dropped(f) - dropped0;
+    full1 = drv_stat("wr_blocked");
+    afull1 = drv_stat("almost_full");
+    secs = (t1 - t0) / 1e9;
+    gb = bytes / 1e9;
+    qsort(lat, nlat, sizeof(*lat), cmp_u64);
+
+    printf("{\"tool\":\"readbench\",\"device\":\"%s\",\"mode\":\"%s\",\"chunk\":%zu,"
+           "\"cpu\":%d,\"busy_poll_us\":%u,\"seconds\":%.6f,\"events\":%ld,\"bytes\":%llu,"
+           "\"events_per_s\":%.1f,\"mb_per_s\":%.3f,",
+           devname, nonblock ? "nonblock" : "block", chunk, cpu, busy_us, secs,
+           nevt, (unsigned long long) bytes,
+           secs > 0 ? nevt / secs : 0, secs > 0 ? bytes / secs / 1e6 : 0);
+    printf("\"lat_us\":{\"samples\":%ld,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+           "\"p999\":%.3f,\"max\":%.3f},",
+           nlat, pct_us(lat, nlat, 0.5), pct_us(lat, nlat, 0.9), pct_us(lat, nlat, 0.99),
+           pct_us(lat, nlat, 0.999), pct_us(lat, nlat, 1.0));
+    printf("\"seq_gaps\":%llu,\"dropped\":%llu,\"drop_rate\":%.6f,",
+           (unsigned long long) gaps, (unsigned long long) dropped,
+           (nevt + gaps) ? (double) gaps / (nevt + gaps) : 0);
+    if ((full0 >= 0) && (full1 >= 0))
+        printf("\"ring_full\":%lld,\"ring_full_per_s\":%.3f,\"almost_full\":%lld,",
+               full1 - full0, secs > 0 ? (full1 - full0) / secs : 0, afull1 - afull0);
+    else
+        printf("\"ring_full\":null,\"ring_full_per_s\":null,\"almost_full\":null,");
+    printf("\"cpu_s\":%.6f,\"cpu_s_per_gb\":%.6f}\n",
+           c1 - c0, gb > 0 ? (c1 - c0) / gb : 0);
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d <device>     device file (default %s)\n"
+            "  -n <events>     stop after this many events per run (default: no limit)\n"
+            "  -t <seconds>    stop after this long per run, 0 = no limit (default 10)\n"
+            "  -c <bytes>      read size; a comma-separated list sweeps over sizes\n"
+            "                  (default %d, at least %zu)\n"
+            "  -N              non-blocking reads with poll()\n"
+            "  -p <cpu>        pin the reader to this CPU\n"
+            "  -b <us>         busy-poll this long in read() before sleeping\n"
+            "Prints one JSON object per run.  Ring-full counts need read access\n"
+            "to the driver's debugfs statistics.\n",
+            prog, DEVNAME, MAXEVTSIZE, sizeof(evtframe));
+}
+
+int main(int argc, char **argv) {
+    int f, opt, i, ret = 0;
+    unsigned char *buf;
+    uint64_t *lat;
+    char *tok;
+    cpu_set_t set;
+    struct sigaction sa;
+
+    while ((opt = getopt(argc, argv, "d:n:t:c:Np:b:h")) != -1) {
+        switch (opt) {
+        case 'd': devname = optarg; break;
+        case 'n': maxevts = atol(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'c':
+            nchunk = 0;
+            for (tok = strtok(optarg, ","); tok && (nchunk < MAXSWEEP); tok = strtok(NULL, ","))
+                chunks[nchunk++] = strtoul(tok, NULL, 0);
+            break;
+        case 'N': nonblock = 1; break;
+        case 'p': cpu = atoi(optarg); break;
+        case 'b': busy_us = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((maxevts == 0) && (duration <= 0)) {
+        fprintf(stderr, "readbench: need an event count or a duration\n");
+        return 1;
+    }
+    for (i = 0; i < nchunk; i++) {
+        if ((chunks[i] < sizeof(evtframe)) || (chunks[i] > MAXEVTSIZE + sizeof(evtframe))) {
+            fprintf(stderr, "readbench: bad read size %zu\n", chunks[i]);
+            return 1;
+        }
+    }
+
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            fprintf(stderr, "readbench: can't pin to CPU %d: %s\n", cpu, strerror(errno));
+            return 1;
+        }
+    }
+
+    // The timer must interrupt a blocked read
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_alarm;
+    sigaction(SIGALRM, &sa, NULL);
+    sa.sa_handler = on_int;
+    sigaction(SIGINT, &sa, NULL);
+
+    buf = (unsigned char *) malloc(MAXEVTSIZE + sizeof(evtframe));
+    lat = (uint64_t *) malloc(MAXLAT * sizeof(*lat));
+    if ((buf == NULL) || (lat == NULL)) {
+        fprintf(stderr, "readbench: couldn't allocate buffers\n");
+        return 1;
+    }
+
+    f = open(devname, O_RDONLY | (nonblock ? O_NONBLOCK : 0));
+    if (f < 0) {
+        fprintf(stderr, "readbench: couldn't open %s: %s\n", devname, strerror(errno));
+        return 1;
+    }
+    if (ioctl(f, XPCIE_IOCTL_FRAMED, 1) < 0) {
+        fprintf(stderr, "readbench: driver has no framed reads: %s\n", strerror(errno));
+        return 1;
+    }
+    if (busy_us && (ioctl(f, XPCIE_IOCTL_BUSY_POLL, busy_us) < 0)) {
+        fprintf(stderr, "readbench: can't busy-poll: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; (i < nchunk) && (ret == 0) && !quit; i++) {
+        fprintf(stderr, "readbench: %s, read size %zu\n", devname, chunks[i]);
+        ret = run(f, buf, chunks[i], lat);
+    }
+
+    close(f);
+    free(buf);
+    free(lat);
+    return ret ? 1 : 0;
+}